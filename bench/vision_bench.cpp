@@ -0,0 +1,139 @@
+
+// Checks that the SSE2 vision kernels match their scalar reference bit for bit and
+// times the whole Vision::process pipeline on 640x480 frames against a 60 fps budget.
+
+#include "vision.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int Width = 640;
+static const int Height = 480;
+static const int Frames = 600;
+static const double FrameBudget = 1000.0 / 60.0;
+
+static bool check(const char* kernel, const std::vector<uint8_t>& simd, const std::vector<uint8_t>& scalar)
+{
+    if (simd == scalar)
+        return true;
+
+    printf("FAIL: %s differs from its scalar reference\n", kernel);
+    return false;
+}
+
+static bool checkKernels(const std::vector<uint8_t>& rgba)
+{
+    // odd sizes so the scalar tails of the SIMD loops are exercised as well
+    const int width = Width - 3;
+    const int height = Height - 1;
+    const int count = width * height;
+
+    bool ok = true;
+
+    std::vector<uint8_t> gray(count), grayReference(count);
+    vision::rgbaToGray(rgba.data(), gray.data(), count);
+    vision::scalar::rgbaToGray(rgba.data(), grayReference.data(), count);
+    ok &= check("rgbaToGray", gray, grayReference);
+
+    std::vector<uint8_t> small((width / 2) * (height / 2)), smallReference(small.size());
+    vision::downscale2x(gray.data(), width, height, small.data());
+    vision::scalar::downscale2x(gray.data(), width, height, smallReference.data());
+    ok &= check("downscale2x", small, smallReference);
+
+    std::vector<uint8_t> blurred(count), blurredReference(count), scratch(count);
+    vision::blur3x3(gray.data(), width, height, blurred.data(), scratch.data());
+    vision::scalar::blur3x3(gray.data(), width, height, blurredReference.data(), scratch.data());
+    ok &= check("blur3x3", blurred, blurredReference);
+
+    for (uint8_t threshold: { 0, 8, 30, 200 })
+    {
+        if (vision::frameDiff(gray.data(), blurred.data(), count, threshold) !=
+            vision::scalar::frameDiff(gray.data(), blurred.data(), count, threshold))
+        {
+            printf("FAIL: frameDiff differs from its scalar reference\n");
+            ok = false;
+        }
+    }
+
+    std::vector<uint8_t> edges(width), edgesReference(width);
+    for (int y = 1; y < height - 1; y += 7)
+    {
+        vision::edgeRow(gray.data(), width, y, 20, edges.data());
+        vision::scalar::edgeRow(gray.data(), width, y, 20, edgesReference.data());
+        ok &= check("edgeRow", edges, edgesReference);
+    }
+
+    return ok;
+}
+
+int main()
+{
+    std::mt19937 random(18);
+    std::uniform_int_distribution<int> byte(0, 255);
+
+    // a noisy frame and a flat floor with a checkered obstacle on the left
+    std::vector<uint8_t> noise(Width * Height * 4);
+    std::vector<uint8_t> scene(Width * Height * 4);
+
+    for (auto& value: noise)
+    {
+        value = (uint8_t)byte(random);
+    }
+
+    for (int y = 0; y < Height; y++)
+    {
+        for (int x = 0; x < Width; x++)
+        {
+            uint8_t* pixel = &scene[(y * Width + x) * 4];
+            bool obstacle = x < Width / 3 && y > Height * 2 / 3;
+            uint8_t value = (uint8_t)(120 + (obstacle ? ((x / 6 + y / 6) % 2) * 100 : 0));
+
+            pixel[0] = pixel[1] = pixel[2] = value;
+            pixel[3] = 255;
+        }
+    }
+
+#ifdef HEXBOT_SSE2
+    printf("kernels: SSE2\n");
+#else
+    printf("kernels: scalar only\n");
+#endif
+
+    bool ok = checkKernels(noise) && checkKernels(scene);
+
+    Vision vision;
+    CameraResult result;
+    CameraFrame frame;
+    frame.width = Width;
+    frame.height = Height;
+    frame.dataLength = Width * Height * 4;
+
+    auto started = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < Frames; i++)
+    {
+        memset(&result, 0, sizeof(result));
+        frame.frame = i + 1;
+        frame.data = (i & 1) ? noise.data() : scene.data();
+        vision.process(frame, result);
+    }
+
+    double perFrame = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - started).count() / Frames;
+
+    printf("Vision::process %dx%d: %.3f ms per frame (%.0f fps), budget %.3f ms\n",
+        Width, Height, perFrame, 1000.0 / perFrame, FrameBudget);
+    printf("last frame: motion %.3f, obstacles %.2f / %.2f / %.2f\n",
+        result.motion, result.obstacleLeft, result.obstacleCenter, result.obstacleRight);
+
+    if (perFrame > FrameBudget)
+    {
+        printf("FAIL: does not keep up with 60 fps\n");
+        ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
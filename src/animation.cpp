@@ -6,16 +6,29 @@
 #include "animation_frame.h"
 #include "animation_set.h"
 #include "animation_char.h"
+#include "log.h"
+#include "state_machine.h"
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <set>
+#include <stdexcept>
 
-AnimationPtr Animation::Create(const std::string& filename)
+AnimationPtr Animation::Create(const std::string& filename, const AnimationResolver& resolver)
 {
-    return AnimationPtr(new Animation(filename));
+    return AnimationPtr(new Animation(filename, resolver));
 }
 
-Animation::Animation(const std::string& filename)
+Animation::Animation(const std::string& filename, const AnimationResolver& resolver) :
+    m_loop(false),
+    m_length(0),
+    m_negate(false)
 {
+    size_t slash = filename.find_last_of("/\\");
+    m_name = filename.substr(slash == std::string::npos ? 0 : slash + 1);
+    m_name = m_name.substr(0, m_name.find_last_of('.'));
+
     std::ifstream t(filename);
     std::string str((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
 
@@ -27,9 +40,168 @@ Animation::Animation(const std::string& filename)
         abort();
     }
 
+    if (root.isMember("base"))
+    {
+        size_t directory = filename.find_last_of("/\\");
+        std::string base = root["base"].asString();
+
+        readDerived(root, resolver(directory == std::string::npos ? base : filename.substr(0, directory + 1) + base));
+        return;
+    }
+
     read(root);
 }
 
+void Animation::readDerived(const Json::Value& data, const AnimationPtr& base)
+{
+    m_base = base;
+    m_loop = base->isLoop();
+    m_length = base->getLength();
+    m_negate = data["negate"].asBool() != base->isNegated();
+
+    const Json::Value& remap = data["remap"];
+    for (Json::ValueConstIterator it = remap.begin(); it != remap.end(); it++)
+    {
+        m_remap.emplace(it.name(), it->asString());
+    }
+
+    m_timeline = base->getTimeline();
+
+    if (data["reverse"].asBool())
+    {
+        reverseTimeline();
+    }
+
+    uint32_t phase = m_length ? data["phase"].asUInt() % m_length : 0;
+    if (phase == 0)
+        return;
+
+    // wrapped the way generateFrames does, a keyframe landing right on the length stays
+    // there; the wrapped entries move to the front, ahead of a keyframe that lands at the
+    // same time from the start of the base cycle
+    std::stable_partition(m_timeline.begin(), m_timeline.end(), [this, phase](const TimelineEntry& entry)
+    {
+        return std::min(entry.position, m_length) + phase > m_length;
+    });
+
+    for (TimelineEntry& entry: m_timeline)
+    {
+        entry.position = std::min(entry.position, m_length) + phase;
+        if (entry.position > m_length)
+        {
+            entry.position -= m_length;
+        }
+    }
+}
+
+void Animation::reverseTimeline()
+{
+    struct Move
+    {
+        uint32_t position;
+        uint32_t rank;
+        uint32_t frame;
+        uint32_t index;
+    };
+
+    const BoundFrames& frames = getFrames();
+
+    // every move of the timeline, grouped by the servo it drives, in playing order
+    std::map<std::string, std::vector<Move>> servos;
+
+    for (uint32_t i = 0; i < m_timeline.size(); i++)
+    {
+        const TimelineEntry& entry = m_timeline[i];
+        const BoundFrame::FrameMoves& moves = frames[entry.frame].getMoves();
+        if (moves.size() > 64)
+        {
+            throw std::runtime_error("Reversed animations support up to 64 moves per frame");
+        }
+
+        uint32_t index = 0;
+        for (auto it = moves.begin(); it != moves.end(); it++, index++)
+        {
+            if (entry.moves & (1ull << index))
+            {
+                Move move;
+                move.position = std::min(entry.position, m_length);
+                move.rank = (uint32_t)m_timeline.size() - i;
+                move.frame = entry.frame;
+                move.index = index;
+                servos[it->first].push_back(move);
+            }
+        }
+    }
+
+    // (position, rank) -> (frame, moves of the frame played at that position); the rank
+    // counts original entries backwards, so moves landing at the same time play in reverse
+    // original order and the one that came first originally is the one that holds
+    std::map<std::pair<uint32_t, uint32_t>, std::pair<uint32_t, uint64_t>> reversed;
+
+    for (const auto& it: servos)
+    {
+        const std::vector<Move>& moves = it.second;
+
+        for (size_t i = 0; i < moves.size(); i++)
+        {
+            int64_t next = i + 1 < moves.size() ? moves[i + 1].position :
+                (m_loop ? (int64_t)moves[0].position + m_length : m_length);
+
+            int64_t position = (int64_t)m_length - next;
+            if (m_loop && m_length)
+            {
+                position = ((position % m_length) + m_length) % m_length;
+            }
+
+            std::pair<uint32_t, uint64_t>& played = reversed[std::make_pair((uint32_t)std::max<int64_t>(position, 0), moves[i].rank)];
+            played.first = moves[i].frame;
+            played.second |= 1ull << moves[i].index;
+        }
+    }
+
+    m_timeline.clear();
+    m_timeline.reserve(reversed.size());
+
+    for (const auto& it: reversed)
+    {
+        TimelineEntry entry;
+        entry.position = it.first.first;
+        entry.frame = it.second.first;
+        entry.moves = it.second.second;
+        m_timeline.push_back(entry);
+    }
+}
+
+const std::string& Animation::resolveName(const std::string& name) const
+{
+    const std::string& resolved = m_base ? m_base->resolveName(name) : name;
+
+    if (m_remap.empty())
+        return resolved;
+
+    auto it = m_remap.find(resolved);
+    return it == m_remap.end() ? resolved : it->second;
+}
+
+void Animation::checkBindings(const PlayerBindingsPtr& bindings) const
+{
+    std::set<std::string> unbound;
+
+    for (const BoundFrame& frame: getFrames())
+    {
+        for (const auto& move: frame.getMoves())
+        {
+            const std::string& name = resolveName(move.first);
+
+            if (bindings->getBindings().find(name) == bindings->getBindings().end() &&
+                unbound.insert(name).second)
+            {
+                HEXBOT_LOG(LOG_Warning, "Servo %s of %s has no binding", name.c_str(), m_name.c_str());
+            }
+        }
+    }
+}
+
 void Animation::read(const Json::Value& data)
 {
     m_loop = data["loop"].asBool();
@@ -48,6 +220,19 @@ void Animation::read(const Json::Value& data)
     {
         m_plays.emplace_back(*this, play);
     }
+
+    // compiled once and shared by every instance and derived animation
+    m_frames = generateFrames();
+    m_timeline.reserve(m_frames.size());
+
+    for (size_t i = 0; i < m_frames.size(); i++)
+    {
+        TimelineEntry entry;
+        entry.position = m_frames[i].getPosition();
+        entry.frame = (uint32_t)i;
+        entry.moves = AllMoves;
+        m_timeline.push_back(entry);
+    }
 }
 
 BoundFrame& Animation::findBoundFrame(BoundFrames& frames, uint32_t time)
@@ -118,11 +303,12 @@ AnimationInstance::AnimationInstance(api::MoveServoCallback moveCallback, const
         const PlayerBindingsPtr& bindings, bool autoPlay) :
     m_moveCallback(moveCallback),
     m_time(0),
+    m_loops(0),
+    m_blend(0),
     m_speed(1),
     m_bindings(bindings),
     m_animation(animation),
-    m_frames(animation->generateFrames()),
-    m_currentFrame(m_frames.begin()),
+    m_currentFrame(0),
     m_active(autoPlay)
 {
 }
@@ -130,14 +316,15 @@ AnimationInstance::AnimationInstance(api::MoveServoCallback moveCallback, const
 void AnimationInstance::reset()
 {
     m_time = 0;
-    m_speed = 1;
-    m_currentFrame = m_frames.begin();
+    m_currentFrame = 0;
 }
 
 void AnimationInstance::restart(uint32_t delay, float speed)
 {
-    m_currentFrame = m_frames.begin();
-    m_time = -delay;
+    m_currentFrame = 0;
+    m_time = -(double)delay;
+    m_loops = 0;
+    m_blend = 0;
     m_speed = speed;
     m_active = true;
 }
@@ -152,14 +339,18 @@ void AnimationInstance::stop()
     m_active = false;
 }
 
-void AnimationInstance::activateFrame(const BoundFrame& frame) const
+void AnimationInstance::activateFrame(const BoundFrame& frame, uint32_t position, uint64_t playing, double lateness) const
 {
     const BoundFrame::FrameMoves& moves = frame.getMoves();
 
-    for (auto it = moves.begin(); it != moves.end(); it++)
+    uint32_t index = 0;
+    for (auto it = moves.begin(); it != moves.end(); it++, index++)
     {
+        if (index < 64 && !(playing & (1ull << index)))
+            continue;
+
         const auto& frame = it->second;
-        const std::string& name = it->first;
+        const std::string& name = m_animation->resolveName(it->first);
         
         auto bit = m_bindings->getBindings().find(name);
         if (bit == m_bindings->getBindings().end())
@@ -168,42 +359,105 @@ void AnimationInstance::activateFrame(const BoundFrame& frame) const
         float coef = bit->second.coef;
         float offset = bit->second.offset;
 
-        m_moveCallback(servo, ((float)std::get<0>(frame) * coef) + offset, std::get<1>(frame) * m_speed);
+        float angle = (float)std::get<0>(frame);
+        if (m_animation->isNegated())
+        {
+            angle = -angle;
+        }
+
+        // the move has to land where it would have if the keyframe fired right on time
+        double duration = std::get<1>(frame) / m_speed;
+        if (position < m_blend)
+        {
+            duration = std::max(duration, (double)(m_blend - position) / m_speed);
+        }
+
+        duration = std::min(std::max(0.0, duration - lateness), (double)(UINT32_MAX - 1));
+
+        m_moveCallback(servo, (angle * coef) + offset, (uint32_t)(duration + 0.5));
     }
 }
 
 bool AnimationInstance::update(uint32_t dt)
+{
+    return updateUntil(dt, std::numeric_limits<double>::infinity());
+}
+
+bool AnimationInstance::updateUntil(uint32_t dt, double until)
 {
     if (!m_active)
         return false;
+
+    // a paused instance plays nothing, its keyframes fire once it gets a speed again
+    if (m_speed <= 0)
+        return true;
     
-    m_time += dt * m_speed;
-    
-    if (m_currentFrame != m_frames.end())
+    m_time += dt * (double)m_speed;
+
+    const Animation::Timeline& timeline = m_animation->getTimeline();
+    const BoundFrames& frames = m_animation->getFrames();
+    uint32_t length = m_animation->getLength();
+
+    while (true)
     {
-        while (m_time >= m_currentFrame->getPosition())
+        double limit = until - (double)m_loops * length;
+
+        while (m_currentFrame < timeline.size() && m_time + TimeEpsilon >= timeline[m_currentFrame].position &&
+            timeline[m_currentFrame].position <= limit + TimeEpsilon)
         {
-            activateFrame(*m_currentFrame);
+            const Animation::TimelineEntry& entry = timeline[m_currentFrame];
+
+            // how long ago, in player time, this keyframe was due
+            double lateness = std::max(0.0, (m_time - entry.position) / m_speed);
+
+            activateFrame(frames[entry.frame], entry.position, entry.moves, lateness);
             m_currentFrame++;
-            
-            if (m_currentFrame == m_frames.end())
-                break;
         }
-    }
-    
-    if (m_time >= m_animation->getLength())
-    {
-        reset();
-        
-        if (!m_animation->isLoop())
+
+        if (m_time + TimeEpsilon < length)
+            break;
+
+        if (!m_animation->isLoop() || length == 0)
         {
+            reset();
             stop();
+            break;
         }
+
+        if (length >= limit - TimeEpsilon)
+            break;
+
+        // keep the overshoot so looping animations do not drift
+        m_time -= length;
+        m_currentFrame = 0;
+        m_loops++;
+        m_blend = 0;
     }
     
     return true;
 }
 
+uint32_t AnimationInstance::getNextEventDelay() const
+{
+    if (!m_active || m_speed <= 0)
+        return NoEvent;
+
+    const Animation::Timeline& timeline = m_animation->getTimeline();
+
+    double target = m_animation->getLength();
+    if (m_currentFrame < timeline.size())
+    {
+        target = std::min<double>(target, timeline[m_currentFrame].position);
+    }
+
+    if (m_time + TimeEpsilon >= target)
+        return 0;
+
+    // never 0 here: update would not fire the keyframe yet, and the track would be
+    // rescheduled at the same time forever
+    return std::max<uint32_t>(1, (uint32_t)std::ceil((target - m_time) / m_speed - TimeEpsilon));
+}
+
 // ------------------
 
 
@@ -250,27 +504,94 @@ PlayerBindings::PlayerBindings(const std::string& filename)
 
 void AnimationPlayer::update(uint32_t dt)
 {
-    for (auto it = m_tracks.cbegin(); it != m_tracks.cend() /* not hoisted */; /* no increment */)
+    m_time += dt;
+
+    // transitions go first, so the state being left does not play past its exit time
+    if (m_stateMachine)
+    {
+        evaluateStateMachine(dt);
+    }
+
+    processEvents();
+}
+
+void AnimationPlayer::processEvents()
+{
+    while (!m_events.empty() && m_events.top().time <= m_time)
+    {
+        ScheduledEvent event = m_events.top();
+        m_events.pop();
+
+        if (isStale(event))
+            continue;
+
+        auto it = m_tracks.find(event.track);
+        Track& entry = it->second;
+
+        entry.instance->update((uint32_t)(m_time - entry.lastUpdate));
+        entry.lastUpdate = m_time;
+
+        if (!entry.instance->isActive())
+        {
+            m_tracks.erase(it);
+            continue;
+        }
+
+        schedule(event.track, entry, entry.instance->getNextEventDelay());
+    }
+}
+
+uint32_t AnimationPlayer::getNextEventTime()
+{
+    while (!m_events.empty() && isStale(m_events.top()))
     {
-      if (!it->second->update(dt))
-      {
-        m_tracks.erase(it++);    // or "it = m.erase(it)" since C++11
-      }
-      else
-      {
-        ++it;
-      }
+        m_events.pop();
     }
+
+    uint32_t next = m_stateMachine ? getStateMachineDelay() : AnimationInstance::NoEvent;
+
+    if (m_events.empty())
+        return next;
+
+    uint64_t time = m_events.top().time;
+    return std::min(next, time > m_time ? (uint32_t)std::min<uint64_t>(time - m_time, AnimationInstance::NoEvent - 1) : 0);
+}
+
+void AnimationPlayer::schedule(int track, const Track& entry, uint32_t delay)
+{
+    if (delay == AnimationInstance::NoEvent)
+        return;
+
+    ScheduledEvent event;
+    event.time = m_time + delay;
+    event.track = track;
+    event.generation = entry.generation;
+    m_events.push(event);
+}
+
+bool AnimationPlayer::isStale(const ScheduledEvent& event) const
+{
+    auto it = m_tracks.find(event.track);
+    return it == m_tracks.end() || it->second.generation != event.generation;
 }
 
 AnimationPlayer::AnimationPlayer(api::MoveServoCallback moveCallback) :
-    m_moveCallback(moveCallback)
+    m_time(0),
+    m_generation(0),
+    m_moveCallback(moveCallback),
+    m_stateTrack(0)
 {
 }
 
-void AnimationPlayer::setTrack(int track, const AnimationInstancePtr& instance)
+void AnimationPlayer::setTrack(int track, const AnimationInstancePtr& instance, uint32_t elapsed)
 {
-    m_tracks[track] = instance;
+    Track& entry = m_tracks[track];
+    entry.instance = instance;
+    entry.lastUpdate = m_time - std::min<uint64_t>(elapsed, m_time);
+    entry.generation = ++m_generation;
+
+    // picked up on the next update: either its first keyframes fire, or it gets removed if not playing
+    schedule(track, entry, 0);
 }
 
 void AnimationPlayer::setTrack(int track, const AnimationPtr& animation, float delay, float speed, const PlayerBindingsPtr& bindings)
@@ -279,3 +600,152 @@ void AnimationPlayer::setTrack(int track, const AnimationPtr& animation, float d
     instance->restart(delay, speed);
     setTrack(track, instance);
 }
+
+void AnimationPlayer::setTrackSpeed(int track, float speed)
+{
+    auto it = m_tracks.find(track);
+    if (it == m_tracks.end())
+        return;
+
+    Track& entry = it->second;
+
+    // play the elapsed time at the old speed first
+    entry.instance->update((uint32_t)(m_time - entry.lastUpdate));
+    entry.lastUpdate = m_time;
+
+    if (!entry.instance->isActive())
+    {
+        m_tracks.erase(it);
+        return;
+    }
+
+    entry.instance->setSpeed(speed);
+    entry.generation = ++m_generation;
+    schedule(track, entry, entry.instance->getNextEventDelay());
+}
+
+const AnimationInstancePtr& AnimationPlayer::getTrackInstance(int track) const
+{
+    static const AnimationInstancePtr none;
+
+    auto it = m_tracks.find(track);
+    return it == m_tracks.end() ? none : it->second.instance;
+}
+
+void AnimationPlayer::setStateMachine(int track, const StateMachinePtr& stateMachine)
+{
+    m_stateMachine = stateMachine;
+    m_stateTrack = track;
+
+    if (m_stateMachine)
+    {
+        m_stateMachine->reset();
+        enterState(0, 0);
+    }
+}
+
+double AnimationPlayer::getNormalizedTime(int track) const
+{
+    auto it = m_tracks.find(track);
+    if (it == m_tracks.end() || !it->second.instance->isActive())
+        return std::numeric_limits<double>::infinity();
+
+    const Track& entry = it->second;
+    const AnimationInstancePtr& instance = entry.instance;
+    double length = instance->getAnimation()->getLength();
+
+    if (length <= 0)
+        return std::numeric_limits<double>::infinity();
+
+    // the instance itself is only brought up to date when its next keyframe is due
+    double played = instance->getLoops() * length + instance->getTime() +
+        (double)(m_time - entry.lastUpdate) * instance->getSpeed();
+
+    return played / length;
+}
+
+void AnimationPlayer::evaluateStateMachine(uint32_t dt)
+{
+    // follow transitions that are already due, at most once through every state
+    for (uint32_t step = 0; step < m_stateMachine->getStatesCount(); step++)
+    {
+        double normalized = getNormalizedTime(m_stateTrack);
+        uint32_t found = m_stateMachine->findTransition(normalized);
+
+        if (found == StateMachine::NoTransition)
+            break;
+
+        const StateMachine::Transition& transition = m_stateMachine->getTransition(found);
+
+        // the exit time passed somewhere within this tick, start the next state from there
+        uint32_t elapsed = 0;
+        const AnimationInstancePtr& current = getTrackInstance(m_stateTrack);
+
+        if (transition.exitTime >= 0 && current && std::isfinite(normalized) && current->getSpeed() > 0)
+        {
+            double late = (normalized - transition.exitTime) * current->getAnimation()->getLength() / current->getSpeed();
+            elapsed = (uint32_t)std::min<double>(late, dt);
+        }
+
+        leaveState(transition.exitTime);
+        m_stateMachine->enter(transition.target);
+        enterState(transition.blend, elapsed);
+    }
+
+    m_stateMachine->clearDirty();
+}
+
+void AnimationPlayer::leaveState(double exitTime)
+{
+    auto it = m_tracks.find(m_stateTrack);
+    if (it == m_tracks.end())
+        return;
+
+    Track& entry = it->second;
+    double until = exitTime >= 0 ? exitTime * entry.instance->getAnimation()->getLength() : std::numeric_limits<double>::infinity();
+
+    // keyframes up to the exit still play, those after it belong to the state taking over
+    entry.instance->updateUntil((uint32_t)(m_time - entry.lastUpdate), until);
+    entry.lastUpdate = m_time;
+}
+
+void AnimationPlayer::enterState(uint32_t blend, uint32_t elapsed)
+{
+    const StateMachine::State& entered = m_stateMachine->getState();
+
+    const AnimationInstancePtr& instance = entered.animation->newInstance(m_moveCallback, m_stateMachine->getBindings());
+    instance->restart(0, m_stateSpeedCallback ? m_stateSpeedCallback(entered.animation, entered.speed) : entered.speed);
+    instance->setBlend(blend);
+    setTrack(m_stateTrack, instance, elapsed);
+}
+
+uint32_t AnimationPlayer::getStateMachineDelay() const
+{
+    if (m_stateMachine->isDirty())
+        return 0;
+
+    const StateMachine::State& state = m_stateMachine->getState();
+    const AnimationInstancePtr& current = getTrackInstance(m_stateTrack);
+    double normalized = getNormalizedTime(m_stateTrack);
+
+    uint32_t next = AnimationInstance::NoEvent;
+
+    for (uint32_t i = state.transitionsBegin; i < state.transitionsEnd; i++)
+    {
+        const StateMachine::Transition& transition = m_stateMachine->getTransition(i);
+
+        if (!m_stateMachine->conditionsHold(transition))
+            continue;
+
+        if (transition.exitTime < 0 || normalized >= transition.exitTime)
+            return 0;
+
+        if (current && current->getSpeed() > 0)
+        {
+            double remaining = (transition.exitTime - normalized) * current->getAnimation()->getLength() / current->getSpeed();
+            next = std::min(next, (uint32_t)std::ceil(remaining));
+        }
+    }
+
+    return next;
+}
@@ -8,40 +8,88 @@
 typedef std::shared_ptr<class Animation> AnimationPtr;
 typedef std::shared_ptr<class PlayerBindings> PlayerBindingsPtr;
 typedef std::shared_ptr<class AnimationInstance> AnimationInstancePtr;
+typedef std::shared_ptr<class StateMachine> StateMachinePtr;
 
-typedef std::list<class BoundFrame> BoundFrames;
+typedef std::vector<class BoundFrame> BoundFrames;
 typedef std::list<class AnimationFrame> AnimationFrames;
 typedef std::map<std::string, class AnimationSet> AnimationSets;
 typedef std::list<class AnimationSetPlay> AnimationSetPlays;
 
+typedef std::function<AnimationPtr(const std::string& filename)> AnimationResolver;
+
+// An animation is either defined by its own keyframe sets, or derived from a base
+// animation ("base": "left.json") through a transform: servo names remapped through
+// a "remap" table with optional angle "negate" (side mirror), "reverse"d in time,
+// and a "phase" offset in ms. Derived animations share the base frames and only
+// keep their own timeline, an ordered index into them. A base may be derived
+// itself, the transforms are composed.
+//
+// Reversal works per servo: the move a servo starts at t(k) is played at L - t(k + 1),
+// the time its next move would start (L past its last one, or its first one a cycle
+// later for looping animations), so every pose is held between the same neighbours.
 class Animation: public std::enable_shared_from_this<Animation>
 {
 public:
-    static AnimationPtr Create(const std::string& filename);
+    // `resolver` loads base animations of derived ones, given their path, and has to
+    // reject cyclic bases
+    static AnimationPtr Create(const std::string& filename, const AnimationResolver& resolver);
+
+    // moves of a frame are addressed by their order in BoundFrame::FrameMoves
+    static const uint64_t AllMoves = UINT64_MAX;
+
+    struct TimelineEntry
+    {
+        uint32_t position;
+        uint32_t frame;
+        uint64_t moves;
+    };
+
+    typedef std::vector<TimelineEntry> Timeline;
+    typedef std::map<std::string, std::string> Remap;
     
 public:
     AnimationInstancePtr newInstance(
         api::MoveServoCallback moveCallback,
         const PlayerBindingsPtr& bindings,
         bool autoPlay = false);
+    const std::string& getName() const { return m_name; }
     const AnimationSets& getSets() const { return m_sets; }
     bool isLoop() const { return m_loop; }
     uint32_t getLength() const { return m_length; }
 
+    const BoundFrames& getFrames() const { return m_base ? m_base->getFrames() : m_frames; }
+    const Timeline& getTimeline() const { return m_timeline; }
+    bool isNegated() const { return m_negate; }
+
+    // name a move of the base frames is played on by this animation
+    const std::string& resolveName(const std::string& name) const;
+
+    // activateFrame skips unbound servos silently, this reports them once at load time
+    void checkBindings(const PlayerBindingsPtr& bindings) const;
+
     BoundFrames generateFrames() const;
 
 private:
     static BoundFrame& findBoundFrame(BoundFrames& frames, uint32_t time);
-    Animation(const std::string& filename);
+    Animation(const std::string& filename, const AnimationResolver& resolver);
     
 protected:
     void read(const Json::Value& data);
+    void readDerived(const Json::Value& data, const AnimationPtr& base);
+    void reverseTimeline();
     
 private:
+    std::string m_name;
     bool m_loop;
     uint32_t m_length;
     AnimationSets m_sets;
     AnimationSetPlays m_plays;
+    BoundFrames m_frames;
+    Timeline m_timeline;
+
+    AnimationPtr m_base;
+    Remap m_remap;
+    bool m_negate;
 };
 
 class AnimationInstance
@@ -61,25 +109,46 @@ private:
         bool autoPlay);
     
 public:
+    static const uint32_t NoEvent = UINT32_MAX;
+
     bool update(uint32_t dt);
+    // plays `dt` ms like update, but nothing past `until`, the played time of the animation
+    // loops included: keyframes after it, or of a loop starting right at it, are left out
+    bool updateUntil(uint32_t dt, double until);
 
     void restart(uint32_t delay = 0, float speed = 1);
     void start();
     void stop();
+    void setSpeed(float speed) { m_speed = speed; }
+    // moves of keyframes within the first `blend` ms take at least until then to land
+    void setBlend(uint32_t blend) { m_blend = blend; }
+
+    bool isActive() const { return m_active; }
+    double getTime() const { return m_time; }
+    uint32_t getLoops() const { return m_loops; }
+    float getSpeed() const { return m_speed; }
+    const AnimationPtr& getAnimation() const { return m_animation; }
+
+    // time until the next keyframe or the end of the animation, NoEvent if there is none
+    uint32_t getNextEventDelay() const;
     
 private:
     
-    void activateFrame(const BoundFrame& frame) const;
+    void activateFrame(const BoundFrame& frame, uint32_t position, uint64_t playing, double lateness) const;
     void reset();
     
 private:
+    static constexpr double TimeEpsilon = 1e-6;
+
     api::MoveServoCallback m_moveCallback;
-    uint32_t m_time;
+    // local animation time in fractional ms, negative while a restart delay runs out
+    double m_time;
+    uint32_t m_loops;
+    uint32_t m_blend;
     float m_speed;
-    AnimationPtr m_animation;
     PlayerBindingsPtr m_bindings;
-    BoundFrames m_frames;
-    BoundFrames::const_iterator m_currentFrame;
+    AnimationPtr m_animation;
+    size_t m_currentFrame;
     bool m_active;
 };
 
@@ -115,18 +184,81 @@ private:
     Bindings m_bindings;
 };
 
+// Tracks are only updated when they have something to do: every track schedules its
+// next keyframe in a min-heap keyed by player time, so update costs O(due events)
+// rather than O(tracks). A track brings its animation up to date from the time it
+// was last touched. Replaced tracks leave stale heap entries behind, those are
+// recognized by their generation and skipped.
 class AnimationPlayer
 {
 public:
     AnimationPlayer(api::MoveServoCallback moveCallback);
 
     void update(uint32_t dt);
-    void setTrack(int track, const AnimationInstancePtr& instance);
+    // `elapsed` is how long ago, in player time, the instance should have been started
+    void setTrack(int track, const AnimationInstancePtr& instance, uint32_t elapsed = 0);
     void setTrack(int track, const AnimationPtr& animation, float delay, float speed, const PlayerBindingsPtr& bindings);
+    // changes the playback speed of a track in place, without restarting its animation
+    void setTrackSpeed(int track, float speed);
+    const AnimationInstancePtr& getTrackInstance(int track) const;
+
+    uint64_t getTime() const { return m_time; }
+
+    // time until the next track has something to do, AnimationInstance::NoEvent if nothing is playing
+    uint32_t getNextEventTime();
+
+    struct Track
+    {
+        AnimationInstancePtr instance;
+        uint64_t lastUpdate;
+        uint32_t generation;
+    };
+
+    typedef std::map<int, Track> Tracks;
+
+    const Tracks& getTracks() const { return m_tracks; }
+
+    // lets the state machine drive `track`, starting from its initial state
+    void setStateMachine(int track, const StateMachinePtr& stateMachine);
+    const StateMachinePtr& getStateMachine() const { return m_stateMachine; }
+
+    // picks the speed an entered state plays at, given its animation and the speed it asks for
+    typedef std::function<float(const AnimationPtr& animation, float speed)> StateSpeedCallback;
+    void setStateSpeedCallback(const StateSpeedCallback& callback) { m_stateSpeedCallback = callback; }
     
 private:
-    std::map<int, AnimationInstancePtr> m_tracks;
+    struct ScheduledEvent
+    {
+        uint64_t time;
+        int track;
+        uint32_t generation;
+
+        bool operator>(const ScheduledEvent& other) const { return time > other.time; }
+    };
+
+    typedef std::priority_queue<ScheduledEvent, std::vector<ScheduledEvent>, std::greater<ScheduledEvent>> EventQueue;
+
+    void schedule(int track, const Track& entry, uint32_t delay);
+    bool isStale(const ScheduledEvent& event) const;
+    void processEvents();
+
+    // played time of a track in lengths of its animation, infinite once it is over
+    double getNormalizedTime(int track) const;
+    void evaluateStateMachine(uint32_t dt);
+    void leaveState(double exitTime);
+    void enterState(uint32_t blend, uint32_t elapsed);
+    uint32_t getStateMachineDelay() const;
+
+private:
+    Tracks m_tracks;
+    EventQueue m_events;
+    uint64_t m_time;
+    uint32_t m_generation;
     api::MoveServoCallback m_moveCallback;
+
+    StateMachinePtr m_stateMachine;
+    int m_stateTrack;
+    StateSpeedCallback m_stateSpeedCallback;
 };
 
 #endif
@@ -1,17 +1,22 @@
 
 #include "api.h"
 #include "main.h"
+#include "log.h"
+#include "state_machine.h"
 
 int RoboInit(
     const char* contentsDirectory,
     api::LogCallback logCallback,
     api::MoveServoCallback moveServoCallback
 ) {
-    return Hexbot::Create(
+    int result = Hexbot::Create(
         std::string(contentsDirectory),
         logCallback,
         moveServoCallback
     );
+
+    Logger::getInstance().flush();
+    return result;
 }
 
 void RoboUpdate(uint32_t dt)
@@ -19,7 +24,113 @@ void RoboUpdate(uint32_t dt)
     Hexbot::getInstance()->update(dt);
 }
 
+uint32_t RoboNextEventTime()
+{
+    return Hexbot::getInstance()->getNextEventTime();
+}
+
 void RoboMove(MovementState state)
 {
+    Hexbot::getInstance()->stopDriving();
     Hexbot::getInstance()->move(state, 1.f);
 }
+
+int RoboGetParameterIndex(const char* name)
+{
+    const StateMachinePtr& stateMachine = Hexbot::getInstance()->getPlayer().getStateMachine();
+    return stateMachine ? stateMachine->findParameter(std::string(name)) : -1;
+}
+
+void RoboSetParameter(int parameter, int value)
+{
+    const StateMachinePtr& stateMachine = Hexbot::getInstance()->getPlayer().getStateMachine();
+    if (stateMachine)
+    {
+        stateMachine->setParameter(parameter, value);
+    }
+}
+
+void RoboDrive(float vx, float vy, float yaw)
+{
+    Hexbot::getInstance()->drive(vx, vy, yaw);
+}
+
+int RoboSimulate(uint32_t duration, uint32_t step, ServoCommand* buffer, int capacity)
+{
+    return Hexbot::getInstance()->simulate(duration, step, buffer, capacity);
+}
+
+int RoboSimulateToFile(uint32_t duration, uint32_t step, const char* filename)
+{
+    return Hexbot::getInstance()->simulate(duration, step, std::string(filename));
+}
+
+int RoboEnableSharedState(const char* name)
+{
+    return Hexbot::getInstance()->getSharedState().open(std::string(name)) ? 1 : 0;
+}
+
+void RoboDisableSharedState()
+{
+    Hexbot::getInstance()->getSharedState().close();
+}
+
+void RoboSetLogLevel(LogLevel level)
+{
+    Logger::getInstance().setLevel(level);
+}
+
+int RoboFlushLogs()
+{
+    return Logger::getInstance().flush();
+}
+
+uint64_t RoboGetDroppedLogs()
+{
+    return Logger::getInstance().getDropped();
+}
+
+void RoboStartLogThread(uint32_t interval)
+{
+    Logger::getInstance().startThread(interval);
+}
+
+void RoboStopLogThread()
+{
+    Logger::getInstance().stopThread();
+}
+
+int RoboCameraRegisterBuffer(void* data, int dataLength)
+{
+    return Hexbot::getInstance()->getCamera().registerBuffer(data, dataLength);
+}
+
+void RoboCameraUnregisterBuffers()
+{
+    Hexbot::getInstance()->getCamera().unregisterBuffers();
+}
+
+void* RoboCameraAcquireBuffer()
+{
+    return Hexbot::getInstance()->getCamera().acquireBuffer();
+}
+
+void RoboCameraSnapshot(int width, int height, int dataLength, void* data)
+{
+    Hexbot::getInstance()->cameraSnapshot(width, height, dataLength, data);
+}
+
+void RoboCameraSetBottomUp(int bottomUp)
+{
+    Hexbot::getInstance()->getVision().setBottomUp(bottomUp != 0);
+}
+
+void RoboGetCameraResult(CameraResult* result)
+{
+    *result = Hexbot::getInstance()->getCameraResult();
+}
+
+MovementState RoboCameraSteer(MovementState wanted, float threshold)
+{
+    return Vision::steer(Hexbot::getInstance()->getCameraResult(), wanted, threshold);
+}
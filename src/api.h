@@ -28,6 +28,10 @@ extern "C"
     
 	SPEC_API void RoboUpdate(uint32_t dt);
 
+    // ms until the next servo command is due, so the host can sleep until then
+    // and pass that time to RoboUpdate; UINT32_MAX if nothing is playing
+    SPEC_API uint32_t RoboNextEventTime();
+
 	enum MovementState
     {
 	    MOVE_Stop = 0,
@@ -39,6 +43,92 @@ extern "C"
     };
 
     SPEC_API void RoboMove(MovementState state);
+
+    // parameters of the content state machine (states.json), RoboMove sets "move" if it
+    // is declared; the index lookup is meant to be done once, -1 if there is no such parameter
+    SPEC_API int RoboGetParameterIndex(const char* name);
+    SPEC_API void RoboSetParameter(int parameter, int value);
+
+    // continuous velocity command, every axis within -1..1 (positive vy and yaw go left);
+    // picks the dominant gait and eases its playback speed in place
+    SPEC_API void RoboDrive(float vx, float vy, float yaw);
+
+    struct ServoCommand
+    {
+        uint32_t time;      // ms since the start of the simulated span
+        int servo;
+        float angle;
+        uint32_t duration;
+    };
+
+    struct CameraResult
+    {
+        uint32_t frame;             // sequence number of the processed frame, 0 if none yet
+        int width;
+        int height;
+        uint32_t processingTime;    // microseconds
+
+        float motion;               // fraction of pixels changed since the previous frame
+        float obstacleLeft;         // 0..1, how cluttered the floor in front of the robot is
+        float obstacleCenter;
+        float obstacleRight;
+        uint16_t occupancy[4];      // occupied cells of the floor grid, far to near, one bit per column
+    };
+
+    // camera frames are RGBA and are never copied: the host registers its frame buffers
+    // once, fills one returned by RoboCameraAcquireBuffer (or any registered buffer
+    // that is not in use) and passes it to RoboCameraSnapshot
+    SPEC_API int RoboCameraRegisterBuffer(void* data, int dataLength);
+    // releases every registered buffer, blocks until the core stopped reading them
+    SPEC_API void RoboCameraUnregisterBuffers();
+    SPEC_API void* RoboCameraAcquireBuffer();
+    SPEC_API void RoboCameraSnapshot(int width, int height, int dataLength, void* data);
+    SPEC_API void RoboCameraSetBottomUp(int bottomUp);
+
+    // latest result picked up by RoboUpdate, a new `frame` number means a new result.
+    // Each obstacle score covers a third of the floor band (the lower 40% of the image):
+    // 0 when its cells show no edges, 1 when all of them are edge-dense, nearer cells
+    // weighing more. `occupancy` has the per-cell detail, `motion` is only meaningful
+    // while the robot stands still, since its own moves change the whole image
+    SPEC_API void RoboGetCameraResult(CameraResult* result);
+
+    // turns `wanted` into a movement that avoids the obstacles of the latest camera
+    // result: MOVE_Forward becomes MOVE_Left or MOVE_Right toward the clearer side when
+    // the center score reaches `threshold` (0.5 is a sensible start), MOVE_Stop when
+    // every side is blocked; anything else is returned as is
+    SPEC_API MovementState RoboCameraSteer(MovementState wanted, float threshold);
+
+    // publishes the live servo targets and playing animations into a POSIX shared
+    // memory region, see shared_state.h for its layout; returns 0 on failure
+    SPEC_API int RoboEnableSharedState(const char* name);
+    SPEC_API void RoboDisableSharedState();
+
+    enum LogLevel
+    {
+        LOG_Debug = 0,
+        LOG_Info,
+        LOG_Warning,
+        LOG_Error
+    };
+
+    // log records are queued without blocking and only reach the LogCallback
+    // on RoboFlushLogs or from the drain thread started with RoboStartLogThread
+    SPEC_API void RoboSetLogLevel(LogLevel level);
+    SPEC_API int RoboFlushLogs();
+    SPEC_API uint64_t RoboGetDroppedLogs();
+    SPEC_API void RoboStartLogThread(uint32_t interval);
+    SPEC_API void RoboStopLogThread();
+
+    // advances the player through `duration` ms in `step` ms ticks without calling
+    // the host servo callback; returns the total amount of commands emitted,
+    // only the first `capacity` of them are written into `buffer`.
+    // A `step` of 0 advances from one event to the next (see RoboNextEventTime),
+    // so every command carries the exact time of its keyframe
+    SPEC_API int RoboSimulate(uint32_t duration, uint32_t step, ServoCommand* buffer, int capacity);
+
+    // same as above, but streams the commands into a "time,servo,angle,duration" text file;
+    // returns -1 if the file cannot be opened
+    SPEC_API int RoboSimulateToFile(uint32_t duration, uint32_t step, const char* filename);
 }
 
 #endif
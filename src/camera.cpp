@@ -0,0 +1,239 @@
+
+#include "camera.h"
+#include "log.h"
+
+#include <chrono>
+#include <cstring>
+
+CameraPipeline::CameraPipeline() :
+    m_buffersCount(0),
+    m_pending(-1),
+    m_frameCounter(0),
+    m_dropped(0),
+    m_running(false),
+    m_resultMiddle(1),
+    m_resultBack(0),
+    m_resultFront(2)
+{
+    memset(m_results, 0, sizeof(m_results));
+}
+
+CameraPipeline::~CameraPipeline()
+{
+    stop();
+}
+
+void CameraPipeline::setProcessor(const Processor& processor)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_processor = processor;
+}
+
+int CameraPipeline::registerBuffer(void* data, int dataLength)
+{
+    int index;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_buffersCount >= MaxBuffers)
+        {
+            HEXBOT_LOG(LOG_Warning, "Camera buffer pool is full (%d buffers)", MaxBuffers);
+            return -1;
+        }
+
+        Buffer& buffer = m_buffers[m_buffersCount];
+        buffer.data = (uint8_t*)data;
+        buffer.dataLength = dataLength;
+        buffer.state = Buffer_Free;
+        index = m_buffersCount++;
+    }
+
+    start();
+    return index;
+}
+
+void CameraPipeline::unregisterBuffers()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // a pending frame is simply forgotten, but the one being processed has to be finished first
+    m_pending = -1;
+
+    m_released.wait(lock, [this]()
+    {
+        for (int i = 0; i < m_buffersCount; i++)
+        {
+            if (m_buffers[i].state == Buffer_Processing)
+                return false;
+        }
+
+        return true;
+    });
+
+    m_buffersCount = 0;
+}
+
+void* CameraPipeline::acquireBuffer()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (int i = 0; i < m_buffersCount; i++)
+    {
+        if (m_buffers[i].state == Buffer_Free)
+        {
+            m_buffers[i].state = Buffer_Host;
+            return m_buffers[i].data;
+        }
+    }
+
+    return nullptr;
+}
+
+bool CameraPipeline::submit(int width, int height, int dataLength, void* data)
+{
+    if (width <= 0 || height <= 0 || dataLength < width * height * 4)
+    {
+        HEXBOT_LOG(LOG_Warning, "Camera frame %dx%d does not fit %d bytes", width, height, dataLength);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        int index = -1;
+        for (int i = 0; i < m_buffersCount; i++)
+        {
+            if (m_buffers[i].data == data)
+            {
+                index = i;
+                break;
+            }
+        }
+
+        if (index < 0)
+        {
+            HEXBOT_LOG(LOG_Warning, "Camera frame was not submitted from a registered buffer");
+            return false;
+        }
+
+        Buffer& buffer = m_buffers[index];
+
+        if (dataLength > buffer.dataLength)
+        {
+            HEXBOT_LOG(LOG_Warning, "Camera frame of %d bytes does not fit buffer %d of %d bytes",
+                dataLength, index, buffer.dataLength);
+            return false;
+        }
+
+        if (buffer.state == Buffer_Pending || buffer.state == Buffer_Processing)
+        {
+            HEXBOT_LOG(LOG_Warning, "Camera buffer %d is still in use by the core", index);
+            return false;
+        }
+
+        // latest frame wins
+        if (m_pending >= 0)
+        {
+            m_buffers[m_pending].state = Buffer_Free;
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        buffer.state = Buffer_Pending;
+        buffer.frame.frame = ++m_frameCounter;
+        buffer.frame.width = width;
+        buffer.frame.height = height;
+        buffer.frame.dataLength = dataLength;
+        buffer.frame.data = buffer.data;
+        m_pending = index;
+    }
+
+    m_wakeup.notify_one();
+    return true;
+}
+
+bool CameraPipeline::poll(CameraResult& result)
+{
+    if ((m_resultMiddle.load(std::memory_order_acquire) & ResultDirty) == 0)
+        return false;
+
+    m_resultFront = m_resultMiddle.exchange(m_resultFront, std::memory_order_acq_rel) & ~ResultDirty;
+    result = m_results[m_resultFront];
+    return true;
+}
+
+void CameraPipeline::publish(const CameraResult& result)
+{
+    m_results[m_resultBack] = result;
+    m_resultBack = m_resultMiddle.exchange(m_resultBack | ResultDirty, std::memory_order_acq_rel) & ~ResultDirty;
+}
+
+void CameraPipeline::start()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_running)
+        return;
+
+    m_running = true;
+    m_thread = std::thread(&CameraPipeline::run, this);
+}
+
+void CameraPipeline::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_running)
+            return;
+
+        m_running = false;
+    }
+
+    m_wakeup.notify_all();
+    m_thread.join();
+}
+
+void CameraPipeline::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        m_wakeup.wait(lock, [this]() { return !m_running || m_pending >= 0; });
+
+        if (!m_running)
+            break;
+
+        Buffer& buffer = m_buffers[m_pending];
+        buffer.state = Buffer_Processing;
+        m_pending = -1;
+
+        CameraFrame frame = buffer.frame;
+        Processor processor = m_processor;
+
+        lock.unlock();
+
+        auto started = std::chrono::steady_clock::now();
+
+        CameraResult result;
+        memset(&result, 0, sizeof(result));
+        result.frame = frame.frame;
+        result.width = frame.width;
+        result.height = frame.height;
+
+        if (processor)
+        {
+            processor(frame, result);
+        }
+
+        result.processingTime = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count();
+
+        publish(result);
+
+        lock.lock();
+        buffer.state = Buffer_Free;
+        m_released.notify_all();
+    }
+}
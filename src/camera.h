@@ -0,0 +1,98 @@
+
+#ifndef HEXBOT_CAMERA_H
+#define HEXBOT_CAMERA_H
+
+#include "api.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+struct CameraFrame
+{
+    uint32_t frame;
+    int width;
+    int height;
+    int dataLength;
+    const uint8_t* data;    // RGBA, 4 bytes per pixel
+};
+
+// Zero-copy camera ingestion: the host registers its own frame buffers once, fills
+// one it acquired and submits it. Frames are processed on a worker thread straight
+// from the host memory; while one frame is being processed only the latest submitted
+// one is kept pending (older pending frames are dropped), so with three buffers
+// the host always has one to fill. Results are handed to the control loop through
+// a lock-free triple buffer, so polling them never blocks.
+class CameraPipeline
+{
+public:
+    typedef std::function<void(const CameraFrame&, CameraResult&)> Processor;
+
+    static const int MaxBuffers = 4;
+
+public:
+    CameraPipeline();
+    ~CameraPipeline();
+
+    void setProcessor(const Processor& processor);
+
+    int registerBuffer(void* data, int dataLength);
+    // waits for the frame in processing, if any, and empties the pool;
+    // the host may free or resize its buffers once this returns
+    void unregisterBuffers();
+    void* acquireBuffer();
+    bool submit(int width, int height, int dataLength, void* data);
+
+    // control loop side, returns true if a new result was published since the last poll
+    bool poll(CameraResult& result);
+
+    uint32_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    enum BufferState
+    {
+        Buffer_Free = 0,
+        Buffer_Host,
+        Buffer_Pending,
+        Buffer_Processing
+    };
+
+    struct Buffer
+    {
+        uint8_t* data;
+        int dataLength;
+        BufferState state;
+        CameraFrame frame;
+    };
+
+    void start();
+    void stop();
+    void run();
+    void publish(const CameraResult& result);
+
+private:
+    Buffer m_buffers[MaxBuffers];
+    int m_buffersCount;
+    int m_pending;
+    uint32_t m_frameCounter;
+    std::atomic<uint32_t> m_dropped;
+
+    Processor m_processor;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::condition_variable m_released;
+    std::thread m_thread;
+    bool m_running;
+
+    static const int ResultDirty = 4;
+
+    CameraResult m_results[3];
+    std::atomic<int> m_resultMiddle;
+    int m_resultBack;
+    int m_resultFront;
+};
+
+#endif //HEXBOT_CAMERA_H
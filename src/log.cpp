@@ -0,0 +1,157 @@
+
+#include "log.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <chrono>
+
+static const char* LevelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+Logger& Logger::getInstance()
+{
+    static Logger instance;
+    return instance;
+}
+
+Logger::Logger() :
+    m_enqueuePos(0),
+    m_dequeuePos(0),
+    m_dropped(0),
+    m_level(LOG_Info),
+    m_callback(nullptr),
+    m_reportedDropped(0),
+    m_threadRunning(false)
+{
+    for (size_t i = 0; i < Capacity; i++)
+    {
+        m_records[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+Logger::~Logger()
+{
+    stopThread();
+}
+
+void Logger::setCallback(api::LogCallback callback)
+{
+    std::lock_guard<std::mutex> lock(m_flushMutex);
+    m_callback = callback;
+}
+
+void Logger::write(LogLevel level, const char* format, ...)
+{
+    if (!isEnabled(level))
+        return;
+
+    Record* record;
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        record = &m_records[pos & (Capacity - 1)];
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // the ring is full, the drain is behind
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    int prefix = snprintf(record->text, RecordSize, "[%s] ", LevelNames[level]);
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text + prefix, RecordSize - prefix, format, args);
+    va_end(args);
+
+    record->sequence.store(pos + 1, std::memory_order_release);
+}
+
+int Logger::flush()
+{
+    std::lock_guard<std::mutex> lock(m_flushMutex);
+
+    int delivered = 0;
+    size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        Record& record = m_records[pos & (Capacity - 1)];
+        size_t sequence = record.sequence.load(std::memory_order_acquire);
+
+        // only one consumer at a time thanks to m_flushMutex, so no CAS is needed here
+        if (sequence != pos + 1)
+            break;
+
+        if (m_callback)
+        {
+            m_callback(record.text);
+        }
+
+        record.sequence.store(pos + Capacity, std::memory_order_release);
+        m_dequeuePos.store(++pos, std::memory_order_relaxed);
+        delivered++;
+    }
+
+    uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+    if (dropped != m_reportedDropped && m_callback)
+    {
+        char text[RecordSize];
+        snprintf(text, RecordSize, "[%s] %llu log messages dropped",
+            LevelNames[LOG_Warning], (unsigned long long)(dropped - m_reportedDropped));
+        m_callback(text);
+        m_reportedDropped = dropped;
+    }
+
+    return delivered;
+}
+
+void Logger::startThread(uint32_t interval)
+{
+    stopThread();
+
+    if (interval == 0)
+        interval = 1;
+
+    m_threadRunning = true;
+    m_thread = std::thread([this, interval]()
+    {
+        std::unique_lock<std::mutex> lock(m_threadMutex);
+
+        while (m_threadRunning)
+        {
+            m_threadWakeup.wait_for(lock, std::chrono::milliseconds(interval));
+
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+    });
+}
+
+void Logger::stopThread()
+{
+    if (!m_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_threadMutex);
+        m_threadRunning = false;
+    }
+
+    m_threadWakeup.notify_all();
+    m_thread.join();
+}
@@ -0,0 +1,74 @@
+
+#ifndef HEXBOT_LOG_H
+#define HEXBOT_LOG_H
+
+#include "api.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Non-blocking log subsystem: producers format records straight into a fixed-size
+// lock-free ring (bounded MPMC queue), and records are handed over to the host's
+// LogCallback either by a drain thread or by an explicit flush() call.
+// When the ring is full the record is dropped and counted, never waited for.
+class Logger
+{
+public:
+    static Logger& getInstance();
+
+    static const size_t RecordSize = 256;
+    static const size_t Capacity = 1024;
+
+public:
+    Logger();
+    ~Logger();
+
+    void setCallback(api::LogCallback callback);
+    void setLevel(LogLevel level) { m_level.store(level, std::memory_order_relaxed); }
+    bool isEnabled(LogLevel level) const { return level >= m_level.load(std::memory_order_relaxed); }
+
+    void write(LogLevel level, const char* format, ...)
+#ifdef __GNUC__
+        __attribute__((format(printf, 3, 4)))
+#endif
+        ;
+
+    // delivers all pending records to the callback, returns the amount delivered
+    int flush();
+    uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    void startThread(uint32_t interval);
+    void stopThread();
+
+private:
+    struct Record
+    {
+        std::atomic<size_t> sequence;
+        char text[RecordSize];
+    };
+
+    Record m_records[Capacity];
+    std::atomic<size_t> m_enqueuePos;
+    std::atomic<size_t> m_dequeuePos;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<int> m_level;
+
+    // consumer side only, producers never touch these
+    std::mutex m_flushMutex;
+    api::LogCallback m_callback;
+    uint64_t m_reportedDropped;
+
+    std::thread m_thread;
+    std::mutex m_threadMutex;
+    std::condition_variable m_threadWakeup;
+    bool m_threadRunning;
+};
+
+#define HEXBOT_LOG(level, ...) \
+    do { if (Logger::getInstance().isEnabled(level)) Logger::getInstance().write(level, __VA_ARGS__); } while (0)
+
+#endif //HEXBOT_LOG_H
@@ -1,9 +1,22 @@
 
 #include "main.h"
 #include "animation.h"
+#include "log.h"
+#include "state_machine.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
 
 HexbotPtr Hexbot::s_instance = nullptr;
 
+static const float DriveDeadZone = 0.05f;
+static const float DriveHysteresis = 0.1f;
+static const float DriveMinSpeed = 0.25f;
+static const float DriveAcceleration = 2.f;     // playback speed change per second
+static const uint32_t DriveRampInterval = 20;
+
 int Hexbot::Create(
     const std::string& contentsDirectory,
     api::LogCallback logCallback,
@@ -15,7 +28,7 @@ int Hexbot::Create(
 
 void Hexbot::log(const std::string& data)
 {
-    m_logCallback(data.c_str());
+    HEXBOT_LOG(LOG_Info, "%s", data.c_str());
 }
 
 int Hexbot::randomInt(int a, int b)
@@ -32,9 +45,161 @@ float Hexbot::randomFloat(float a, float b)
 
 void Hexbot::update(uint32_t dt)
 {
+    m_camera.poll(m_cameraResult);
+
+    advance(dt);
+
+    if (m_sharedState.isOpen())
+    {
+        publishSharedState();
+    }
+}
+
+// everything that moves forward with time, shared by the host ticks and the simulation
+void Hexbot::advance(uint32_t dt)
+{
+    if (m_driving)
+    {
+        updateDrive(dt);
+    }
+
     m_player.update(dt);
 }
 
+void Hexbot::publishSharedState()
+{
+    shared::Snapshot& snapshot = m_sharedState.getSnapshot();
+    snapshot.time = m_player.getTime();
+    snapshot.tracksCount = 0;
+
+    for (const auto& it: m_player.getTracks())
+    {
+        if (snapshot.tracksCount >= (uint32_t)shared::MaxTracks)
+            break;
+
+        const AnimationInstancePtr& instance = it.second.instance;
+        shared::TrackState& track = snapshot.tracks[snapshot.tracksCount++];
+
+        track.track = it.first;
+        track.speed = instance->getSpeed();
+        // the instance is only brought up to date when its next keyframe is due
+        track.position = instance->getTime() + (double)(m_player.getTime() - it.second.lastUpdate) * track.speed;
+        strncpy(track.animation, instance->getAnimation()->getName().c_str(), shared::MaxNameLength - 1);
+        track.animation[shared::MaxNameLength - 1] = 0;
+    }
+
+    m_sharedState.publish();
+}
+
+uint32_t Hexbot::getNextEventTime()
+{
+    uint32_t next = m_player.getNextEventTime();
+
+    // the speed ramp of a drive command needs ticks of its own
+    if (m_driving && m_driveSpeed != m_driveTargetSpeed)
+    {
+        next = std::min(next, DriveRampInterval);
+    }
+
+    return next;
+}
+
+void Hexbot::cameraSnapshot(int width, int height, int dataLength, void* data)
+{
+    m_camera.submit(width, height, dataLength, data);
+}
+
+bool Hexbot::MoveServo(int servo, float angle, uint32_t time)
+{
+    return s_instance->moveServo(servo, angle, time);
+}
+
+bool Hexbot::moveServo(int servo, float angle, uint32_t time)
+{
+    if (m_simulationRecorder)
+    {
+        ServoCommand command;
+        command.time = m_simulationTime;
+        command.servo = servo;
+        command.angle = angle;
+        command.duration = time;
+
+        m_simulationRecorder(command);
+        return true;
+    }
+
+    if (m_sharedState.isOpen())
+    {
+        m_sharedState.setServo(servo, angle, time, m_player.getTime());
+    }
+
+    return m_moveServoCallback(servo, angle, time);
+}
+
+int Hexbot::simulate(uint32_t duration, uint32_t step, const SimulationRecorder& recorder)
+{
+    int emitted = 0;
+
+    m_simulationRecorder = [&recorder, &emitted](const ServoCommand& command)
+    {
+        recorder(command);
+        emitted++;
+    };
+
+    m_simulationTime = 0;
+    uint32_t previous = 1;
+
+    while (m_simulationTime < duration)
+    {
+        // without a step, jump straight from one keyframe to the next so every
+        // command is emitted exactly at its own time
+        uint32_t dt = step ? step : getNextEventTime();
+
+        // something that stays due right after being updated must not stall the simulation
+        if (dt == 0 && previous == 0)
+            dt = 1;
+
+        dt = std::min(dt, duration - m_simulationTime);
+        previous = dt;
+
+        m_simulationTime += dt;
+        advance(dt);
+    }
+
+    m_simulationRecorder = nullptr;
+    return emitted;
+}
+
+int Hexbot::simulate(uint32_t duration, uint32_t step, ServoCommand* buffer, int capacity)
+{
+    int written = 0;
+
+    return simulate(duration, step, [buffer, capacity, &written](const ServoCommand& command)
+    {
+        if (written < capacity)
+        {
+            buffer[written++] = command;
+        }
+    });
+}
+
+int Hexbot::simulate(uint32_t duration, uint32_t step, const std::string& filename)
+{
+    std::ofstream f(filename);
+    if (!f)
+    {
+        HEXBOT_LOG(LOG_Error, "Failed to open simulation output %s", filename.c_str());
+        return -1;
+    }
+
+    f << "time,servo,angle,duration\n";
+
+    return simulate(duration, step, [&f](const ServoCommand& command)
+    {
+        f << command.time << ',' << command.servo << ',' << command.angle << ',' << command.duration << '\n';
+    });
+}
+
 Hexbot::Hexbot(
         const std::string& contentsDirectory,
         api::LogCallback logCallback, 
@@ -43,53 +208,196 @@ Hexbot::Hexbot(
 
     m_contentsDirectory(contentsDirectory),
     m_logCallback(logCallback),
-    m_player(moveServoCallback)
+    m_moveServoCallback(moveServoCallback),
+    m_simulationTime(0),
+    m_player(&Hexbot::MoveServo),
+    m_moveParameter(-1),
+    m_driving(false),
+    m_driveState(MOVE_Stop),
+    m_driveSpeed(0),
+    m_driveTargetSpeed(0)
 {
-    m_forwardAnimation = Animation::Create(m_contentsDirectory + "/forward.json");
-    m_backwardAnimation = Animation::Create(m_contentsDirectory + "/backward.json");
-    m_leftAnimation = Animation::Create(m_contentsDirectory + "/left.json");
-    m_rightAnimation = Animation::Create(m_contentsDirectory + "/right.json");
-    m_stayAnimation = Animation::Create(m_contentsDirectory + "/stay.json");
-    m_sitAnimation = Animation::Create(m_contentsDirectory + "/sit.json");
+    Logger::getInstance().setCallback(m_logCallback);
+    memset(&m_cameraResult, 0, sizeof(m_cameraResult));
+    m_camera.setProcessor([this](const CameraFrame& frame, CameraResult& result)
+    {
+        m_vision.process(frame, result);
+    });
+
+    m_forwardAnimation = loadAnimation(m_contentsDirectory + "/forward.json");
+    m_backwardAnimation = loadAnimation(m_contentsDirectory + "/backward.json");
+    m_leftAnimation = loadAnimation(m_contentsDirectory + "/left.json");
+    m_rightAnimation = loadAnimation(m_contentsDirectory + "/right.json");
+    m_stayAnimation = loadAnimation(m_contentsDirectory + "/stay.json");
+    m_sitAnimation = loadAnimation(m_contentsDirectory + "/sit.json");
 
     m_playerBindings = PlayerBindings::Create(m_contentsDirectory + "/bindings.json");
+
+    // sequencing is left to the host unless the content comes with a state machine
+    const std::string states = m_contentsDirectory + "/states.json";
+    if (std::ifstream(states).good())
+    {
+        StateMachinePtr stateMachine = StateMachine::Create(states, [this](const std::string& filename)
+        {
+            return loadAnimation(filename);
+        }, m_playerBindings);
+
+        m_moveParameter = stateMachine->findParameter("move");
+        m_player.setStateMachine(0, stateMachine);
+
+        // a gait entered while driving starts right away at the stick speed
+        m_player.setStateSpeedCallback([this](const AnimationPtr& animation, float speed)
+        {
+            return m_driving && m_driveState != MOVE_Stop && animation == getMoveAnimation(m_driveState) ? m_driveSpeed : speed;
+        });
+    }
+
+    for (const auto& it: m_animations)
+    {
+        it.second->checkBindings(m_playerBindings);
+    }
     
     log("Hexbot Core Initialized!");
 }
 
-void Hexbot::move(MovementState state, float speed)
+AnimationPtr Hexbot::loadAnimation(const std::string& filename)
 {
-    switch (state)
+    // derived animations share the frames of their base, so every file is loaded only once
+    auto it = m_animations.find(filename);
+    if (it != m_animations.end())
+        return it->second;
+
+    if (!m_loadingAnimations.insert(filename).second)
     {
-        case MOVE_Forward:
+        throw std::runtime_error("Cyclic base animation " + filename);
+    }
+
+    AnimationPtr animation = Animation::Create(filename, [this](const std::string& base)
+    {
+        return loadAnimation(base);
+    });
+
+    m_loadingAnimations.erase(filename);
+    m_animations[filename] = animation;
+    return animation;
+}
+
+void Hexbot::drive(float vx, float vy, float yaw)
+{
+    float forward = std::fabs(vx);
+    // there is no strafing gait, sideways velocity is walked with the turning ones
+    float sideways = std::fabs(yaw) >= std::fabs(vy) ? yaw : vy;
+    float lateral = std::fabs(sideways);
+
+    MovementState state = MOVE_Stop;
+    float magnitude = std::max(forward, lateral);
+
+    if (magnitude > DriveDeadZone)
+    {
+        bool wasForward = m_driving && (m_driveState == MOVE_Forward || m_driveState == MOVE_Backward);
+        bool wasLateral = m_driving && (m_driveState == MOVE_Left || m_driveState == MOVE_Right);
+
+        // stick to the current gait unless the other axis clearly dominates
+        bool useForward = forward >= lateral;
+        if (wasForward && forward > DriveDeadZone)
+            useForward = forward + DriveHysteresis >= lateral;
+        else if (wasLateral && lateral > DriveDeadZone)
+            useForward = forward > lateral + DriveHysteresis;
+
+        if (useForward)
         {
-            m_player.setTrack(0, m_forwardAnimation, 0, speed, m_playerBindings);
-            break;
+            state = vx >= 0 ? MOVE_Forward : MOVE_Backward;
+            magnitude = forward;
         }
-        case MOVE_Backward:
+        else
         {
-            m_player.setTrack(0, m_backwardAnimation, 0, speed, m_playerBindings);
-            break;
+            state = sideways >= 0 ? MOVE_Left : MOVE_Right;
+            magnitude = lateral;
         }
+    }
+
+    float speed = state == MOVE_Stop ? 1.f : std::max(DriveMinSpeed, std::min(1.f, magnitude));
+
+    if (!m_driving || state != m_driveState || (state != MOVE_Stop && !m_player.getTrackInstance(0)))
+    {
+        // a different gait has to start over, it begins slow and eases in
+        float initial = state == MOVE_Stop ? speed : DriveMinSpeed;
+
+        move(state, initial);
+
+        m_driving = true;
+        m_driveState = state;
+        m_driveSpeed = initial;
+    }
+
+    m_driveTargetSpeed = speed;
+}
+
+void Hexbot::stopDriving()
+{
+    if (!m_driving)
+        return;
+
+    m_driving = false;
+
+    // the state machine keeps playing the gait, at its own speed again
+    const StateMachinePtr& stateMachine = m_player.getStateMachine();
+    const AnimationInstancePtr& instance = m_player.getTrackInstance(0);
+
+    if (stateMachine && instance && m_driveState != MOVE_Stop && instance->getAnimation() == getMoveAnimation(m_driveState))
+    {
+        m_player.setTrackSpeed(0, stateMachine->getState().speed);
+    }
+}
+
+void Hexbot::updateDrive(uint32_t dt)
+{
+    float step = DriveAcceleration * dt / 1000.f;
+
+    if (std::fabs(m_driveTargetSpeed - m_driveSpeed) <= step)
+        m_driveSpeed = m_driveTargetSpeed;
+    else
+        m_driveSpeed += m_driveTargetSpeed > m_driveSpeed ? step : -step;
+
+    if (m_driveState == MOVE_Stop)
+        return;
+
+    // only the gait itself follows the stick, a state machine may not have entered it yet
+    // or play something else entirely
+    const AnimationInstancePtr& instance = m_player.getTrackInstance(0);
+    if (instance && instance->getAnimation() == getMoveAnimation(m_driveState) && instance->getSpeed() != m_driveSpeed)
+    {
+        m_player.setTrackSpeed(0, m_driveSpeed);
+    }
+}
+
+void Hexbot::move(MovementState state, float speed)
+{
+    const StateMachinePtr& stateMachine = m_player.getStateMachine();
+    if (stateMachine)
+    {
+        stateMachine->setParameter(m_moveParameter, state);
+        return;
+    }
+
+    m_player.setTrack(0, getMoveAnimation(state), 0, speed, m_playerBindings);
+}
+
+const AnimationPtr& Hexbot::getMoveAnimation(MovementState state) const
+{
+    switch (state)
+    {
+        case MOVE_Forward:
+            return m_forwardAnimation;
+        case MOVE_Backward:
+            return m_backwardAnimation;
         case MOVE_Left:
-        {
-            m_player.setTrack(0, m_leftAnimation, 0, speed, m_playerBindings);
-            break;
-        }
+            return m_leftAnimation;
         case MOVE_Right:
-        {
-            m_player.setTrack(0, m_rightAnimation, 0, speed, m_playerBindings);
-            break;
-        }
+            return m_rightAnimation;
         case MOVE_Sit:
-        {
-            m_player.setTrack(0, m_sitAnimation, 0, speed, m_playerBindings);
-            break;
-        }
+            return m_sitAnimation;
         default:
-        {
-            m_player.setTrack(0, m_stayAnimation, 0, speed, m_playerBindings);
-            break;
-        }
+            return m_stayAnimation;
     }
 }
\ No newline at end of file
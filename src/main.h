@@ -5,6 +5,9 @@
 #include "api.h"
 #include "utils.h"
 #include "animation.h"
+#include "camera.h"
+#include "vision.h"
+#include "shared_state.h"
 
 typedef std::shared_ptr<class Hexbot> HexbotPtr;
 
@@ -25,9 +28,15 @@ class Hexbot
             api::MoveServoCallback moveServoCallback);
     
         void update(uint32_t dt);
+        uint32_t getNextEventTime();
         void cameraSnapshot(int width, int height, int dataLength, void* data);
 
         void move(MovementState state, float speed);
+        void drive(float vx, float vy, float yaw);
+        void stopDriving();
+
+        int simulate(uint32_t duration, uint32_t step, ServoCommand* buffer, int capacity);
+        int simulate(uint32_t duration, uint32_t step, const std::string& filename);
     
         int randomInt(int a, int b);
         float randomFloat(float a, float b);
@@ -37,16 +46,40 @@ class Hexbot
     
         const AnimationPlayer& getPlayer() const { return m_player; }
         AnimationPlayer& getPlayer() { return m_player; }
+
+        CameraPipeline& getCamera() { return m_camera; }
+        Vision& getVision() { return m_vision; }
+        SharedState& getSharedState() { return m_sharedState; }
+        const CameraResult& getCameraResult() const { return m_cameraResult; }
     
     private:
         std::random_device m_randomDevice;
         std::mt19937_64 m_randomGen;
     
+    private:
+        typedef std::function<void(const ServoCommand&)> SimulationRecorder;
+
+        static bool MoveServo(int servo, float angle, uint32_t time);
+        bool moveServo(int servo, float angle, uint32_t time);
+        void publishSharedState();
+        AnimationPtr loadAnimation(const std::string& filename);
+        const AnimationPtr& getMoveAnimation(MovementState state) const;
+        void advance(uint32_t dt);
+        void updateDrive(uint32_t dt);
+        int simulate(uint32_t duration, uint32_t step, const SimulationRecorder& recorder);
+
     private:
         static HexbotPtr s_instance;
     
         std::string m_contentsDirectory;
         api::LogCallback m_logCallback;
+        api::MoveServoCallback m_moveServoCallback;
+
+        SimulationRecorder m_simulationRecorder;
+        uint32_t m_simulationTime;
+
+        std::map<std::string, AnimationPtr> m_animations;
+        std::set<std::string> m_loadingAnimations;
 
         AnimationPtr m_forwardAnimation;
         AnimationPtr m_backwardAnimation;
@@ -57,6 +90,18 @@ class Hexbot
 
         PlayerBindingsPtr m_playerBindings;
         AnimationPlayer m_player;
+        int m_moveParameter;
+
+        bool m_driving;
+        MovementState m_driveState;
+        float m_driveSpeed;
+        float m_driveTargetSpeed;
+
+        Vision m_vision;
+        CameraPipeline m_camera;
+        CameraResult m_cameraResult;
+
+        SharedState m_sharedState;
 };
 
 #endif
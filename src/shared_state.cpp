@@ -0,0 +1,113 @@
+
+#include "shared_state.h"
+#include "log.h"
+
+#ifndef WIN32
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
+
+#include <new>
+
+SharedState::SharedState() :
+    m_region(nullptr)
+{
+    memset(&m_snapshot, 0, sizeof(m_snapshot));
+}
+
+SharedState::~SharedState()
+{
+    close();
+}
+
+bool SharedState::open(const std::string& name)
+{
+    close();
+
+#ifdef WIN32
+    HEXBOT_LOG(LOG_Error, "Shared servo state is not supported on this platform");
+    return false;
+#else
+    // POSIX wants the name to start with a slash
+    m_name = name.empty() || name[0] != '/' ? "/" + name : name;
+
+    int fd = shm_open(m_name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        HEXBOT_LOG(LOG_Error, "Failed to open shared memory %s", m_name.c_str());
+        return false;
+    }
+
+    if (ftruncate(fd, sizeof(shared::Region)) != 0)
+    {
+        HEXBOT_LOG(LOG_Error, "Failed to size shared memory %s", m_name.c_str());
+        ::close(fd);
+        shm_unlink(m_name.c_str());
+        return false;
+    }
+
+    void* memory = mmap(nullptr, sizeof(shared::Region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (memory == MAP_FAILED)
+    {
+        HEXBOT_LOG(LOG_Error, "Failed to map shared memory %s", m_name.c_str());
+        shm_unlink(m_name.c_str());
+        return false;
+    }
+
+    m_region = new (memory) shared::Region();
+    m_region->magic = shared::Magic;
+    m_region->version = shared::Version;
+    m_region->sequence.store(0, std::memory_order_relaxed);
+    m_region->reserved = 0;
+    memcpy(&m_region->snapshot, &m_snapshot, sizeof(shared::Snapshot));
+
+    HEXBOT_LOG(LOG_Info, "Publishing servo state to %s", m_name.c_str());
+    return true;
+#endif
+}
+
+void SharedState::close()
+{
+#ifndef WIN32
+    if (m_region == nullptr)
+        return;
+
+    munmap(m_region, sizeof(shared::Region));
+    shm_unlink(m_name.c_str());
+    m_region = nullptr;
+#endif
+}
+
+void SharedState::setServo(int servo, float angle, uint32_t duration, uint64_t time)
+{
+    if (servo < 0 || servo >= shared::MaxServos)
+        return;
+
+    shared::ServoState& state = m_snapshot.servos[servo];
+    state.angle = angle;
+    state.duration = duration;
+    state.time = time;
+
+    if ((uint32_t)servo >= m_snapshot.servosCount)
+    {
+        m_snapshot.servosCount = servo + 1;
+    }
+}
+
+void SharedState::publish()
+{
+    if (m_region == nullptr)
+        return;
+
+    uint32_t sequence = m_region->sequence.load(std::memory_order_relaxed);
+
+    m_region->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(&m_region->snapshot, &m_snapshot, sizeof(shared::Snapshot));
+
+    m_region->sequence.store(sequence + 2, std::memory_order_release);
+}
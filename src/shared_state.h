@@ -0,0 +1,103 @@
+
+#ifndef HEXBOT_SHARED_STATE_H
+#define HEXBOT_SHARED_STATE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Live servo state published into a POSIX shared memory region, so any number of
+// local processes (visualisers, monitors, loggers) can observe the robot without
+// touching the control thread. The region is guarded by a seqlock: the writer never
+// waits, readers copy the snapshot and retry if it changed meanwhile.
+// This header only depends on the standard library so out-of-process consumers
+// can include it as is.
+namespace shared
+{
+    static const uint32_t Magic = 0x53425848; // "HXBS"
+    static const uint32_t Version = 1;
+    static const int MaxServos = 32;
+    static const int MaxTracks = 8;
+    static const int MaxNameLength = 32;
+
+    struct ServoState
+    {
+        float angle;
+        uint32_t duration;
+        uint64_t time;          // player time the command was issued at, ms
+    };
+
+    struct TrackState
+    {
+        int32_t track;
+        float speed;
+        double position;        // local animation time, ms
+        char animation[MaxNameLength];
+    };
+
+    struct Snapshot
+    {
+        uint64_t time;          // player time of the snapshot, ms
+        uint32_t servosCount;
+        uint32_t tracksCount;
+        ServoState servos[MaxServos];
+        TrackState tracks[MaxTracks];
+    };
+
+    struct Region
+    {
+        uint32_t magic;
+        uint32_t version;
+        std::atomic<uint32_t> sequence;     // odd while the writer is updating the snapshot
+        uint32_t reserved;
+        Snapshot snapshot;
+    };
+
+    // copies a consistent snapshot out of the region, false if the writer kept
+    // updating it through all of the attempts
+    inline bool read(const Region& region, Snapshot& snapshot, int attempts = 16)
+    {
+        if (region.magic != Magic || region.version != Version)
+            return false;
+
+        for (int i = 0; i < attempts; i++)
+        {
+            uint32_t before = region.sequence.load(std::memory_order_acquire);
+            if (before & 1)
+                continue;
+
+            memcpy(&snapshot, &region.snapshot, sizeof(Snapshot));
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (region.sequence.load(std::memory_order_relaxed) == before)
+                return true;
+        }
+
+        return false;
+    }
+}
+
+class SharedState
+{
+public:
+    SharedState();
+    ~SharedState();
+
+    bool open(const std::string& name);
+    void close();
+    bool isOpen() const { return m_region != nullptr; }
+
+    // staged locally, nothing reaches the region until publish
+    void setServo(int servo, float angle, uint32_t duration, uint64_t time);
+    shared::Snapshot& getSnapshot() { return m_snapshot; }
+
+    void publish();
+
+private:
+    std::string m_name;
+    shared::Region* m_region;
+    shared::Snapshot m_snapshot;
+};
+
+#endif //HEXBOT_SHARED_STATE_H
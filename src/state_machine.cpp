@@ -0,0 +1,244 @@
+
+#include "state_machine.h"
+#include "animation_char.h"
+
+#include <stdexcept>
+
+StateMachinePtr StateMachine::Create(
+    const std::string& filename,
+    const AnimationResolver& resolver,
+    const PlayerBindingsPtr& bindings)
+{
+    return StateMachinePtr(new StateMachine(filename, resolver, bindings));
+}
+
+StateMachine::StateMachine(const std::string& filename, const AnimationResolver& resolver,
+        const PlayerBindingsPtr& bindings) :
+    m_bindings(bindings),
+    m_initial(0),
+    m_current(0),
+    m_dirty(true)
+{
+    std::ifstream t(filename);
+    std::string str((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+
+    std::string errors;
+    Json::Value root;
+    if (!JSONCharReader::Reader->parse(str.c_str(), str.c_str() + str.size(), &root, &errors))
+    {
+        std::cerr << "Failed to load state machine " << filename << ": " << errors << std::endl;
+        abort();
+    }
+
+    size_t directory = filename.find_last_of("/\\");
+    read(root, directory == std::string::npos ? "" : filename.substr(0, directory + 1), resolver);
+}
+
+void StateMachine::read(const Json::Value& data, const std::string& directory, const AnimationResolver& resolver)
+{
+    for (const auto& parameter: data["parameters"])
+    {
+        m_parameterNames.push_back(parameter.asString());
+    }
+
+    m_parameters.assign(m_parameterNames.size(), 0);
+
+    std::map<std::string, uint32_t> stateNames;
+
+    const Json::Value& states = data["states"];
+    for (Json::ValueConstIterator it = states.begin(); it != states.end(); it++)
+    {
+        const Json::Value& speed = (*it)["speed"];
+
+        State state;
+        state.animation = resolver(directory + (*it)["animation"].asString());
+        state.speed = speed.isNull() ? 1 : speed.asFloat();
+        state.transitionsBegin = 0;
+        state.transitionsEnd = 0;
+
+        stateNames[it.name()] = (uint32_t)m_states.size();
+        m_states.push_back(state);
+    }
+
+    if (m_states.empty())
+    {
+        throw std::runtime_error("State machine has no states");
+    }
+
+    auto findState = [&stateNames](const std::string& name)
+    {
+        auto it = stateNames.find(name);
+        if (it == stateNames.end())
+        {
+            throw std::runtime_error("State was not found");
+        }
+
+        return it->second;
+    };
+
+    m_initial = findState(data["initial"].asString());
+
+    // transitions and their conditions are grouped by source state first, then flattened
+    std::vector<std::vector<std::pair<Transition, std::vector<Condition>>>> outgoing(m_states.size());
+
+    for (const auto& entry: data["transitions"])
+    {
+        const Json::Value& exitTime = entry["exitTime"];
+
+        Transition transition;
+        transition.target = findState(entry["to"].asString());
+        transition.exitTime = exitTime.isNull() ? -1.f : exitTime.asFloat();
+        transition.blend = entry["blend"].asUInt();
+        transition.conditionsBegin = 0;
+        transition.conditionsEnd = 0;
+
+        std::vector<Condition> conditions;
+
+        for (const auto& item: entry["conditions"])
+        {
+            int parameter = findParameter(item["parameter"].asString());
+            if (parameter < 0)
+            {
+                throw std::runtime_error("Parameter was not found");
+            }
+
+            static const char* modes[] = { "equals", "notEquals", "greater", "less" };
+
+            Condition condition;
+            condition.parameter = (uint32_t)parameter;
+            condition.mode = CONDITION_Equals;
+            condition.value = 0;
+
+            for (int mode = 0; mode < 4; mode++)
+            {
+                if (item.isMember(modes[mode]))
+                {
+                    condition.mode = (ConditionMode)mode;
+                    condition.value = item[modes[mode]].asInt();
+                    break;
+                }
+            }
+
+            conditions.push_back(condition);
+        }
+
+        const std::string from = entry["from"].asString();
+
+        if (from == "*")
+        {
+            for (uint32_t state = 0; state < m_states.size(); state++)
+            {
+                if (state != transition.target)
+                {
+                    outgoing[state].emplace_back(transition, conditions);
+                }
+            }
+        }
+        else
+        {
+            outgoing[findState(from)].emplace_back(transition, conditions);
+        }
+    }
+
+    for (uint32_t state = 0; state < m_states.size(); state++)
+    {
+        m_states[state].transitionsBegin = (uint32_t)m_transitions.size();
+
+        for (auto& it: outgoing[state])
+        {
+            Transition& transition = it.first;
+            transition.conditionsBegin = (uint32_t)m_conditions.size();
+            m_conditions.insert(m_conditions.end(), it.second.begin(), it.second.end());
+            transition.conditionsEnd = (uint32_t)m_conditions.size();
+
+            m_transitions.push_back(transition);
+        }
+
+        m_states[state].transitionsEnd = (uint32_t)m_transitions.size();
+    }
+
+    m_current = m_initial;
+}
+
+int StateMachine::findParameter(const std::string& name) const
+{
+    for (size_t i = 0; i < m_parameterNames.size(); i++)
+    {
+        if (m_parameterNames[i] == name)
+            return (int)i;
+    }
+
+    return -1;
+}
+
+void StateMachine::setParameter(int parameter, int value)
+{
+    if (parameter < 0 || parameter >= (int)m_parameters.size() || m_parameters[parameter] == value)
+        return;
+
+    m_parameters[parameter] = value;
+    m_dirty = true;
+}
+
+bool StateMachine::conditionsHold(const Transition& transition) const
+{
+    for (uint32_t i = transition.conditionsBegin; i < transition.conditionsEnd; i++)
+    {
+        const Condition& condition = m_conditions[i];
+        int value = m_parameters[condition.parameter];
+
+        switch (condition.mode)
+        {
+            case CONDITION_Equals:
+            {
+                if (value != condition.value)
+                    return false;
+                break;
+            }
+            case CONDITION_NotEquals:
+            {
+                if (value == condition.value)
+                    return false;
+                break;
+            }
+            case CONDITION_Greater:
+            {
+                if (value <= condition.value)
+                    return false;
+                break;
+            }
+            case CONDITION_Less:
+            {
+                if (value >= condition.value)
+                    return false;
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+uint32_t StateMachine::findTransition(double normalizedTime) const
+{
+    const State& state = getState();
+
+    for (uint32_t i = state.transitionsBegin; i < state.transitionsEnd; i++)
+    {
+        const Transition& transition = m_transitions[i];
+
+        if (transition.exitTime >= 0 && normalizedTime < transition.exitTime)
+            continue;
+
+        if (conditionsHold(transition))
+            return i;
+    }
+
+    return NoTransition;
+}
+
+const StateMachine::State& StateMachine::enter(uint32_t state)
+{
+    m_current = state;
+    return m_states[m_current];
+}
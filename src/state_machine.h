@@ -0,0 +1,107 @@
+
+#ifndef HEXBOT_STATE_MACHINE_H
+#define HEXBOT_STATE_MACHINE_H
+
+#include "animation.h"
+
+// Data driven animation sequencing, loaded with the content:
+//
+// {
+//     "parameters": [ "move" ],
+//     "initial": "stay",
+//     "states": { "stay": { "animation": "stay.json", "speed": 1 }, ... },
+//     "transitions": [
+//         { "from": "sit", "to": "stay", "exitTime": 1, "blend": 200,
+//           "conditions": [ { "parameter": "move", "notEquals": 5 } ] },
+//         ...
+//     ]
+// }
+//
+// States play an animation; a transition is taken once all of its conditions hold
+// and the state animation has played for at least exitTime (in lengths of the
+// animation, so 1 is the end of its first cycle). "from": "*" adds the transition to
+// every other state. The graph is compiled into dense tables: states, their
+// transitions and the conditions of those are contiguous ranges of flat arrays,
+// and parameters are addressed by index, so evaluating it costs no lookups.
+class StateMachine
+{
+public:
+    static StateMachinePtr Create(
+        const std::string& filename,
+        const AnimationResolver& resolver,
+        const PlayerBindingsPtr& bindings);
+
+    static const uint32_t NoTransition = UINT32_MAX;
+
+    enum ConditionMode
+    {
+        CONDITION_Equals = 0,
+        CONDITION_NotEquals,
+        CONDITION_Greater,
+        CONDITION_Less
+    };
+
+    struct Condition
+    {
+        uint32_t parameter;
+        ConditionMode mode;
+        int value;
+    };
+
+    struct Transition
+    {
+        uint32_t target;
+        uint32_t conditionsBegin;
+        uint32_t conditionsEnd;
+        float exitTime;         // negative if the transition does not wait
+        uint32_t blend;
+    };
+
+    struct State
+    {
+        AnimationPtr animation;
+        float speed;
+        uint32_t transitionsBegin;
+        uint32_t transitionsEnd;
+    };
+
+public:
+    int findParameter(const std::string& name) const;
+    void setParameter(int parameter, int value);
+
+    const State& getState() const { return m_states[m_current]; }
+    uint32_t getStatesCount() const { return (uint32_t)m_states.size(); }
+    const Transition& getTransition(uint32_t transition) const { return m_transitions[transition]; }
+    const PlayerBindingsPtr& getBindings() const { return m_bindings; }
+
+    bool conditionsHold(const Transition& transition) const;
+    // first transition out of the current state that can be taken at `normalizedTime`
+    uint32_t findTransition(double normalizedTime) const;
+
+    const State& enter(uint32_t state);
+    void reset() { enter(m_initial); }
+
+    // set whenever a parameter changes, until the player evaluated the graph again
+    bool isDirty() const { return m_dirty; }
+    void clearDirty() { m_dirty = false; }
+
+private:
+    StateMachine(const std::string& filename, const AnimationResolver& resolver, const PlayerBindingsPtr& bindings);
+
+protected:
+    void read(const Json::Value& data, const std::string& directory, const AnimationResolver& resolver);
+
+private:
+    std::vector<State> m_states;
+    std::vector<Transition> m_transitions;
+    std::vector<Condition> m_conditions;
+    std::vector<std::string> m_parameterNames;
+    std::vector<int> m_parameters;
+
+    PlayerBindingsPtr m_bindings;
+    uint32_t m_initial;
+    uint32_t m_current;
+    bool m_dirty;
+};
+
+#endif //HEXBOT_STATE_MACHINE_H
@@ -12,6 +12,10 @@
 #include <streambuf>
 #include <functional>
 #include <list>
+#include <map>
+#include <queue>
+#include <set>
+#include <vector>
 
 #include "json/value.h"
 #include "json/reader.h"
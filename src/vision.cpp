@@ -0,0 +1,453 @@
+
+#include "vision.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#ifdef HEXBOT_SSE2
+#   include <emmintrin.h>
+#endif
+
+static const uint8_t EdgeThreshold = 24;
+static const uint8_t MotionThreshold = 24;
+static const float OccupiedDensity = 0.1f;
+
+static inline uint8_t average(uint8_t a, uint8_t b)
+{
+    return (uint8_t)((a + b + 1) >> 1);
+}
+
+static inline uint8_t absDiff(uint8_t a, uint8_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+#ifdef HEXBOT_SSE2
+
+static inline int popCount16(int mask)
+{
+    mask = mask - ((mask >> 1) & 0x5555);
+    mask = (mask & 0x3333) + ((mask >> 2) & 0x3333);
+    mask = (mask + (mask >> 4)) & 0x0F0F;
+    return (mask + (mask >> 8)) & 0x1F;
+}
+
+static inline __m128i absDiff(__m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+static inline __m128i grayPixels(__m128i rgba)
+{
+    const __m128i rbMask = _mm_set1_epi32(0x00FF00FF);
+    const __m128i rbWeights = _mm_set1_epi32((29 << 16) | 77);
+    const __m128i gWeights = _mm_set1_epi32(150);
+
+    __m128i rb = _mm_madd_epi16(_mm_and_si128(rgba, rbMask), rbWeights);
+    __m128i g = _mm_madd_epi16(_mm_srli_epi16(rgba, 8), gWeights);
+
+    return _mm_srli_epi32(_mm_add_epi32(rb, g), 8);
+}
+
+static inline __m128i pairSums(__m128i v)
+{
+    const __m128i lowMask = _mm_set1_epi16(0x00FF);
+    return _mm_add_epi16(_mm_and_si128(v, lowMask), _mm_srli_epi16(v, 8));
+}
+
+#endif
+
+namespace vision
+{
+    template <bool Simd>
+    void rgbaToGrayKernel(const uint8_t* rgba, uint8_t* gray, int count)
+    {
+        int i = 0;
+
+#ifdef HEXBOT_SSE2
+        if (Simd)
+        {
+            for (; i + 16 <= count; i += 16)
+            {
+                const __m128i* src = (const __m128i*)(rgba + i * 4);
+
+                __m128i y0 = grayPixels(_mm_loadu_si128(src));
+                __m128i y1 = grayPixels(_mm_loadu_si128(src + 1));
+                __m128i y2 = grayPixels(_mm_loadu_si128(src + 2));
+                __m128i y3 = grayPixels(_mm_loadu_si128(src + 3));
+
+                __m128i y = _mm_packus_epi16(_mm_packs_epi32(y0, y1), _mm_packs_epi32(y2, y3));
+                _mm_storeu_si128((__m128i*)(gray + i), y);
+            }
+        }
+#endif
+
+        for (; i < count; i++)
+        {
+            const uint8_t* p = rgba + i * 4;
+            gray[i] = (uint8_t)((77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8);
+        }
+    }
+
+    template <bool Simd>
+    void downscale2xKernel(const uint8_t* src, int width, int height, uint8_t* dst)
+    {
+        int dstWidth = width / 2;
+        int dstHeight = height / 2;
+
+        for (int y = 0; y < dstHeight; y++)
+        {
+            const uint8_t* top = src + (y * 2) * width;
+            const uint8_t* bottom = top + width;
+            uint8_t* out = dst + y * dstWidth;
+
+            int x = 0;
+
+#ifdef HEXBOT_SSE2
+            if (Simd)
+            {
+                const __m128i rounding = _mm_set1_epi16(2);
+
+                for (; x + 16 <= dstWidth; x += 16)
+                {
+                    __m128i t0 = _mm_loadu_si128((const __m128i*)(top + x * 2));
+                    __m128i t1 = _mm_loadu_si128((const __m128i*)(top + x * 2 + 16));
+                    __m128i b0 = _mm_loadu_si128((const __m128i*)(bottom + x * 2));
+                    __m128i b1 = _mm_loadu_si128((const __m128i*)(bottom + x * 2 + 16));
+
+                    __m128i s0 = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(pairSums(t0), pairSums(b0)), rounding), 2);
+                    __m128i s1 = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(pairSums(t1), pairSums(b1)), rounding), 2);
+
+                    _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(s0, s1));
+                }
+            }
+#endif
+
+            for (; x < dstWidth; x++)
+            {
+                out[x] = (uint8_t)((top[x * 2] + top[x * 2 + 1] + bottom[x * 2] + bottom[x * 2 + 1] + 2) >> 2);
+            }
+        }
+    }
+
+    template <bool Simd>
+    void blur3x3Kernel(const uint8_t* src, int width, int height, uint8_t* dst, uint8_t* scratch)
+    {
+        // horizontal pass into scratch
+        for (int y = 0; y < height; y++)
+        {
+            const uint8_t* row = src + y * width;
+            uint8_t* out = scratch + y * width;
+
+            out[0] = row[0];
+            out[width - 1] = row[width - 1];
+
+            int x = 1;
+
+#ifdef HEXBOT_SSE2
+            if (Simd)
+            {
+                for (; x + 16 <= width - 1; x += 16)
+                {
+                    __m128i l = _mm_loadu_si128((const __m128i*)(row + x - 1));
+                    __m128i c = _mm_loadu_si128((const __m128i*)(row + x));
+                    __m128i r = _mm_loadu_si128((const __m128i*)(row + x + 1));
+
+                    _mm_storeu_si128((__m128i*)(out + x), _mm_avg_epu8(_mm_avg_epu8(l, r), c));
+                }
+            }
+#endif
+
+            for (; x < width - 1; x++)
+            {
+                out[x] = average(average(row[x - 1], row[x + 1]), row[x]);
+            }
+        }
+
+        // vertical pass into dst
+        std::copy(scratch, scratch + width, dst);
+        std::copy(scratch + (height - 1) * width, scratch + height * width, dst + (height - 1) * width);
+
+        for (int y = 1; y < height - 1; y++)
+        {
+            const uint8_t* up = scratch + (y - 1) * width;
+            const uint8_t* mid = up + width;
+            const uint8_t* down = mid + width;
+            uint8_t* out = dst + y * width;
+
+            int x = 0;
+
+#ifdef HEXBOT_SSE2
+            if (Simd)
+            {
+                for (; x + 16 <= width; x += 16)
+                {
+                    __m128i u = _mm_loadu_si128((const __m128i*)(up + x));
+                    __m128i m = _mm_loadu_si128((const __m128i*)(mid + x));
+                    __m128i d = _mm_loadu_si128((const __m128i*)(down + x));
+
+                    _mm_storeu_si128((__m128i*)(out + x), _mm_avg_epu8(_mm_avg_epu8(u, d), m));
+                }
+            }
+#endif
+
+            for (; x < width; x++)
+            {
+                out[x] = average(average(up[x], down[x]), mid[x]);
+            }
+        }
+    }
+
+    template <bool Simd>
+    uint32_t frameDiffKernel(const uint8_t* a, const uint8_t* b, int count, uint8_t threshold)
+    {
+        uint32_t changed = 0;
+        int i = 0;
+
+#ifdef HEXBOT_SSE2
+        if (Simd)
+        {
+            const __m128i limit = _mm_set1_epi8((char)threshold);
+            const __m128i zero = _mm_setzero_si128();
+
+            for (; i + 16 <= count; i += 16)
+            {
+                __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+                __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+
+                __m128i over = _mm_subs_epu8(absDiff(va, vb), limit);
+                changed += 16 - popCount16(_mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)));
+            }
+        }
+#endif
+
+        for (; i < count; i++)
+        {
+            if (absDiff(a[i], b[i]) > threshold)
+                changed++;
+        }
+
+        return changed;
+    }
+
+    template <bool Simd>
+    void edgeRowKernel(const uint8_t* src, int width, int y, uint8_t threshold, uint8_t* edges)
+    {
+        const uint8_t* row = src + y * width;
+        const uint8_t* up = row - width;
+        const uint8_t* down = row + width;
+
+        edges[0] = 0;
+        edges[width - 1] = 0;
+
+        int x = 1;
+
+#ifdef HEXBOT_SSE2
+        if (Simd)
+        {
+            const __m128i limit = _mm_set1_epi8((char)threshold);
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i one = _mm_set1_epi8(1);
+
+            for (; x + 16 <= width - 1; x += 16)
+            {
+                __m128i dx = absDiff(
+                    _mm_loadu_si128((const __m128i*)(row + x + 1)),
+                    _mm_loadu_si128((const __m128i*)(row + x - 1)));
+                __m128i dy = absDiff(
+                    _mm_loadu_si128((const __m128i*)(down + x)),
+                    _mm_loadu_si128((const __m128i*)(up + x)));
+
+                __m128i over = _mm_subs_epu8(_mm_adds_epu8(dx, dy), limit);
+                _mm_storeu_si128((__m128i*)(edges + x), _mm_andnot_si128(_mm_cmpeq_epi8(over, zero), one));
+            }
+        }
+#endif
+
+        for (; x < width - 1; x++)
+        {
+            int magnitude = std::min(255, absDiff(row[x + 1], row[x - 1]) + absDiff(down[x], up[x]));
+            edges[x] = magnitude > threshold ? 1 : 0;
+        }
+    }
+    void rgbaToGray(const uint8_t* rgba, uint8_t* gray, int count)
+    {
+        rgbaToGrayKernel<true>(rgba, gray, count);
+    }
+
+    void downscale2x(const uint8_t* src, int width, int height, uint8_t* dst)
+    {
+        downscale2xKernel<true>(src, width, height, dst);
+    }
+
+    void blur3x3(const uint8_t* src, int width, int height, uint8_t* dst, uint8_t* scratch)
+    {
+        blur3x3Kernel<true>(src, width, height, dst, scratch);
+    }
+
+    uint32_t frameDiff(const uint8_t* a, const uint8_t* b, int count, uint8_t threshold)
+    {
+        return frameDiffKernel<true>(a, b, count, threshold);
+    }
+
+    void edgeRow(const uint8_t* src, int width, int y, uint8_t threshold, uint8_t* edges)
+    {
+        edgeRowKernel<true>(src, width, y, threshold, edges);
+    }
+
+    namespace scalar
+    {
+        void rgbaToGray(const uint8_t* rgba, uint8_t* gray, int count)
+        {
+            rgbaToGrayKernel<false>(rgba, gray, count);
+        }
+
+        void downscale2x(const uint8_t* src, int width, int height, uint8_t* dst)
+        {
+            downscale2xKernel<false>(src, width, height, dst);
+        }
+
+        void blur3x3(const uint8_t* src, int width, int height, uint8_t* dst, uint8_t* scratch)
+        {
+            blur3x3Kernel<false>(src, width, height, dst, scratch);
+        }
+
+        uint32_t frameDiff(const uint8_t* a, const uint8_t* b, int count, uint8_t threshold)
+        {
+            return frameDiffKernel<false>(a, b, count, threshold);
+        }
+
+        void edgeRow(const uint8_t* src, int width, int y, uint8_t threshold, uint8_t* edges)
+        {
+            edgeRowKernel<false>(src, width, y, threshold, edges);
+        }
+    }
+}
+
+// ------------------
+
+Vision::Vision() :
+    m_bottomUp(false),
+    m_width(0),
+    m_height(0),
+    m_hasPrevious(false)
+{
+}
+
+void Vision::process(const CameraFrame& frame, CameraResult& result)
+{
+    int width = frame.width / 2;
+    int height = frame.height / 2;
+
+    if (width < 16 || height < 16)
+        return;
+
+    if (frame.width != m_width || frame.height != m_height)
+    {
+        m_width = frame.width;
+        m_height = frame.height;
+        m_hasPrevious = false;
+
+        m_gray.resize(m_width * m_height);
+        m_small.resize(width * height);
+        m_blurred.resize(width * height);
+        m_scratch.resize(width * height);
+        m_previous.resize(width * height);
+        m_edges.resize(width);
+    }
+
+    vision::rgbaToGray(frame.data, m_gray.data(), m_width * m_height);
+    vision::downscale2x(m_gray.data(), m_width, m_height, m_small.data());
+    vision::blur3x3(m_small.data(), width, height, m_blurred.data(), m_scratch.data());
+
+    if (m_hasPrevious)
+    {
+        uint32_t changed = vision::frameDiff(m_blurred.data(), m_previous.data(), width * height, MotionThreshold);
+        result.motion = (float)changed / (float)(width * height);
+    }
+
+    // occupancy grid over the lower 40% of the image, grid row 0 being the farthest one
+    int band = height * 2 / 5;
+    int bandStart = m_bottomUp.load(std::memory_order_relaxed) ? 1 : height - 1 - band;
+
+    uint32_t counts[GridRows][GridColumns] = {};
+    uint32_t pixels[GridRows][GridColumns] = {};
+    int columnEnd[GridColumns];
+
+    for (int c = 0; c < GridColumns; c++)
+    {
+        columnEnd[c] = (c + 1) * width / GridColumns;
+    }
+
+    for (int i = 0; i < band; i++)
+    {
+        int y = bandStart + i;
+        int row = i * GridRows / band;
+
+        if (m_bottomUp.load(std::memory_order_relaxed))
+        {
+            row = GridRows - 1 - row;
+        }
+
+        vision::edgeRow(m_blurred.data(), width, y, EdgeThreshold, m_edges.data());
+
+        int x = 0;
+        for (int c = 0; c < GridColumns; c++)
+        {
+            uint32_t count = 0;
+            int start = x;
+
+            for (; x < columnEnd[c]; x++)
+            {
+                count += m_edges[x];
+            }
+
+            counts[row][c] += count;
+            pixels[row][c] += x - start;
+        }
+    }
+
+    float* scores[3] = { &result.obstacleLeft, &result.obstacleCenter, &result.obstacleRight };
+    const int columnsPerScore = GridColumns / 3;
+
+    for (int s = 0; s < 3; s++)
+    {
+        float score = 0;
+        float weights = 0;
+
+        for (int r = 0; r < GridRows; r++)
+        {
+            // nearer cells matter more
+            float weight = (float)(r + 1);
+
+            for (int c = s * columnsPerScore; c < (s + 1) * columnsPerScore; c++)
+            {
+                float density = pixels[r][c] ? (float)counts[r][c] / (float)pixels[r][c] : 0;
+
+                if (density >= OccupiedDensity)
+                {
+                    result.occupancy[r] |= (uint16_t)(1 << c);
+                }
+
+                score += weight * std::min(1.f, density / OccupiedDensity);
+                weights += weight;
+            }
+        }
+
+        *scores[s] = score / weights;
+    }
+
+    m_previous.swap(m_blurred);
+    m_hasPrevious = true;
+}
+
+MovementState Vision::steer(const CameraResult& result, MovementState wanted, float threshold)
+{
+    if (wanted != MOVE_Forward || result.frame == 0 || result.obstacleCenter < threshold)
+        return wanted;
+
+    if (result.obstacleLeft >= threshold && result.obstacleRight >= threshold)
+        return MOVE_Stop;
+
+    return result.obstacleLeft <= result.obstacleRight ? MOVE_Left : MOVE_Right;
+}
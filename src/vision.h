@@ -0,0 +1,81 @@
+
+#ifndef HEXBOT_VISION_H
+#define HEXBOT_VISION_H
+
+#include "api.h"
+#include "camera.h"
+
+#include <atomic>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define HEXBOT_SSE2
+#endif
+
+// Image kernels, all operating on tightly packed 8-bit images. Every kernel has an
+// SSE2 path and a scalar path that produces bit-exact identical results.
+namespace vision
+{
+    // Y = (77 R + 150 G + 29 B) >> 8
+    void rgbaToGray(const uint8_t* rgba, uint8_t* gray, int count);
+
+    // 2x2 box average, output is (width / 2) x (height / 2)
+    void downscale2x(const uint8_t* src, int width, int height, uint8_t* dst);
+
+    // [1 2 1] x [1 2 1] gaussian approximated with rounding averages, border columns are copied
+    // (the first and last rows are only blurred horizontally), scratch is width x height
+    void blur3x3(const uint8_t* src, int width, int height, uint8_t* dst, uint8_t* scratch);
+
+    // amount of pixels whose absolute difference is above threshold
+    uint32_t frameDiff(const uint8_t* a, const uint8_t* b, int count, uint8_t threshold);
+
+    // edges[x] = 1 where |dx| + |dy| of the row `y` is above threshold, 0 otherwise
+    void edgeRow(const uint8_t* src, int width, int y, uint8_t threshold, uint8_t* edges);
+
+    // the same kernels without SIMD, the reference the SSE2 paths have to match
+    namespace scalar
+    {
+        void rgbaToGray(const uint8_t* rgba, uint8_t* gray, int count);
+        void downscale2x(const uint8_t* src, int width, int height, uint8_t* dst);
+        void blur3x3(const uint8_t* src, int width, int height, uint8_t* dst, uint8_t* scratch);
+        uint32_t frameDiff(const uint8_t* a, const uint8_t* b, int count, uint8_t threshold);
+        void edgeRow(const uint8_t* src, int width, int y, uint8_t threshold, uint8_t* edges);
+    }
+}
+
+// Motion and obstacle cues computed on the camera worker thread: the frame is
+// converted to grayscale, downscaled, blurred, differenced against the previous
+// frame, and the lower band of the image (the floor right in front of the robot)
+// is split into a coarse occupancy grid of edge-dense cells.
+class Vision
+{
+public:
+    static const int GridRows = 4;
+    static const int GridColumns = 12;
+
+public:
+    Vision();
+
+    void process(const CameraFrame& frame, CameraResult& result);
+
+    // Unity hands textures over bottom row first
+    void setBottomUp(bool bottomUp) { m_bottomUp.store(bottomUp, std::memory_order_relaxed); }
+
+    // picks a movement that avoids the obstacles in front of the robot, see RoboCameraSteer
+    static MovementState steer(const CameraResult& result, MovementState wanted, float threshold = 0.5f);
+
+private:
+    std::atomic<bool> m_bottomUp;
+    int m_width;
+    int m_height;
+    bool m_hasPrevious;
+
+    std::vector<uint8_t> m_gray;
+    std::vector<uint8_t> m_small;
+    std::vector<uint8_t> m_blurred;
+    std::vector<uint8_t> m_scratch;
+    std::vector<uint8_t> m_previous;
+    std::vector<uint8_t> m_edges;
+};
+
+#endif //HEXBOT_VISION_H